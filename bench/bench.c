@@ -0,0 +1,489 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * times libxcdbus calls against xcdbus-standin on a private bus, one
+ * backend per run, and prints a JSON object per operation on stdout:
+ *
+ *   {"version":..,"backend":..,"op":..,"latency_us":..,"n":..,"errors":..,
+ *    "ops_per_s":..,"p50_us":..,"p99_us":..,"max_us":..}
+ *
+ * Exits 77 when the backend asked for is not built in.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/select.h>
+
+#ifdef HAVE_LIBEVENT
+#include <event.h>
+#endif
+
+#include "xcdbus.h"
+#include "bench.h"
+
+#define EXIT_SKIP 77
+
+/* give up on a flood when no tick came for this long */
+#define FLOOD_IDLE_MS 5000
+
+static const char *DB_SERVICE = "com.citrix.xenclient.db";
+static const char *XENMGR_SERVICE = "com.citrix.xenclient.xenmgr";
+static const char *XENMGR_OBJ = "/";
+static const char *XENMGR_INTERFACE = "com.citrix.xenclient.xenmgr";
+static const char *INPUT_SERVICE = "com.citrix.xenclient.input";
+
+typedef enum {
+    BACKEND_SELECT,
+    BACKEND_EVENT,
+    BACKEND_GLIB
+} backend_t;
+
+static const char *backend_names[] = { "select", "event", "glib" };
+
+typedef struct sample {
+    int64_t *us;
+    int n;
+    int errors;
+    int64_t elapsed_us;
+} sample_t;
+
+static backend_t backend = BACKEND_SELECT;
+static GMainLoop *gloop = NULL;
+static const char *version = "";
+static int latency_us = 0;
+
+/* signal flood state, filled in by tick_filter */
+static int ticks_wanted = 0;
+static int ticks_seen = 0;
+static int64_t *tick_us = NULL;
+
+static int64_t
+now_us (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int
+cmp_int64 (const void *a, const void *b)
+{
+  int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+  return x < y ? -1 : x > y;
+}
+
+static void
+sample_init (sample_t * s, int n)
+{
+  s->us = g_new0 (int64_t, n);
+  s->n = 0;
+  s->errors = 0;
+  s->elapsed_us = 0;
+}
+
+/* nearest rank */
+static int64_t
+percentile (const sample_t * s, int p)
+{
+  int i;
+  if (!s->n)
+    return 0;
+  i = (s->n * p + 99) / 100 - 1;
+  return s->us[i < 0 ? 0 : i];
+}
+
+static void
+report (const char *op, sample_t * s)
+{
+  double rate = s->elapsed_us ? s->n * 1e6 / s->elapsed_us : 0;
+
+  qsort (s->us, s->n, sizeof (int64_t), cmp_int64);
+  printf ("{\"version\":\"%s\",\"backend\":\"%s\",\"op\":\"%s\","
+          "\"latency_us\":%d,\"n\":%d,\"errors\":%d,\"ops_per_s\":%.1f,"
+          "\"p50_us\":%lld,\"p99_us\":%lld,\"max_us\":%lld}\n",
+          version, backend_names[backend], op, latency_us, s->n, s->errors, rate,
+          (long long) percentile (s, 50), (long long) percentile (s, 99),
+          (long long) (s->n ? s->us[s->n - 1] : 0));
+  fflush (stdout);
+  g_free (s->us);
+  s->us = NULL;
+}
+
+static gboolean
+loop_timeout (gpointer data)
+{
+  return FALSE;
+}
+
+/* run the backend's main loop once, for at most timeout_ms */
+static void
+loop_once (xcdbus_conn_t * c, int timeout_ms)
+{
+  switch (backend)
+    {
+    case BACKEND_SELECT:
+      {
+        fd_set r, w, e;
+        struct timeval tv;
+        int nfds, t;
+
+        FD_ZERO (&r);
+        FD_ZERO (&w);
+        FD_ZERO (&e);
+        nfds = xcdbus_pre_select (c, 0, &r, &w, &e);
+        t = xcdbus_next_timeout (c);
+        if (t < 0 || t > timeout_ms)
+          t = timeout_ms;
+        tv.tv_sec = t / 1000;
+        tv.tv_usec = (t % 1000) * 1000;
+        if (select (nfds, &r, &w, &e, &tv) < 0)
+          {
+            if (errno != EINTR)
+              return;
+            FD_ZERO (&r);
+            FD_ZERO (&w);
+            FD_ZERO (&e);
+          }
+        xcdbus_post_select (c, nfds, &r, &w, &e);
+        break;
+      }
+#ifdef HAVE_LIBEVENT
+    case BACKEND_EVENT:
+      {
+        struct timeval tv;
+        tv.tv_sec = timeout_ms / 1000;
+        tv.tv_usec = (timeout_ms % 1000) * 1000;
+        event_loopexit (&tv);
+        event_loop (EVLOOP_ONCE);
+        break;
+      }
+#endif
+    case BACKEND_GLIB:
+    default:
+      {
+        GMainContext *ctx = g_main_loop_get_context (gloop);
+        /* so the iteration does not block past timeout_ms */
+        GSource *t = g_timeout_source_new (timeout_ms);
+
+        g_source_set_callback (t, loop_timeout, NULL, NULL);
+        g_source_attach (t, ctx);
+        g_main_context_iteration (ctx, TRUE);
+        g_source_destroy (t);
+        g_source_unref (t);
+        break;
+      }
+    }
+}
+
+static xcdbus_conn_t *
+bench_connect (void)
+{
+  switch (backend)
+    {
+    case BACKEND_SELECT:
+      return xcdbus_init (NULL);
+    case BACKEND_EVENT:
+#ifdef HAVE_LIBEVENT
+      {
+        DBusGConnection *conn = dbus_g_bus_get (DBUS_BUS_SYSTEM, NULL);
+        if (!conn)
+          return NULL;
+        event_init ();
+        return xcdbus_init_event (NULL, conn);
+      }
+#else
+      return NULL;
+#endif
+    case BACKEND_GLIB:
+    default:
+      gloop = g_main_loop_new (NULL, FALSE);
+      return xcdbus_init_with_gloop (NULL, NULL, gloop);
+    }
+}
+
+/* the stand-in may still be claiming its names */
+static int
+wait_for_services (xcdbus_conn_t * c)
+{
+  const char *names[] = { DB_SERVICE, XENMGR_SERVICE, INPUT_SERVICE };
+  int i, tries;
+
+  for (i = 0; i < 3; ++i)
+    {
+      for (tries = 0; !xcdbus_name_has_owner (c, names[i]); ++tries)
+        {
+          if (tries == 100)
+            {
+              fprintf (stderr, "xcdbus-bench: %s is not on the bus\n", names[i]);
+              return 0;
+            }
+          usleep (50000);
+        }
+    }
+  return 1;
+}
+
+static void
+bench_read_db (xcdbus_conn_t * c, int iterations)
+{
+  char buf[256];
+  sample_t s;
+  int64_t start, t;
+  int i;
+
+  xcdbus_write_db (c, "/bench/read", "value");
+  sample_init (&s, iterations);
+  start = now_us ();
+  for (i = 0; i < iterations; ++i)
+    {
+      t = now_us ();
+      if (!xcdbus_read_db (c, "/bench/read", buf, sizeof (buf)))
+        s.errors++;
+      s.us[s.n++] = now_us () - t;
+    }
+  s.elapsed_us = now_us () - start;
+  report ("read_db", &s);
+}
+
+static void
+bench_write_db (xcdbus_conn_t * c, int iterations)
+{
+  char value[32];
+  sample_t s;
+  int64_t start, t;
+  int i;
+
+  sample_init (&s, iterations);
+  start = now_us ();
+  for (i = 0; i < iterations; ++i)
+    {
+      snprintf (value, sizeof (value), "%d", i);
+      t = now_us ();
+      if (!xcdbus_write_db (c, "/bench/write", value))
+        s.errors++;
+      s.us[s.n++] = now_us () - t;
+    }
+  s.elapsed_us = now_us () - start;
+  report ("write_db", &s);
+}
+
+static void
+bench_property_get (xcdbus_conn_t * c, int iterations)
+{
+  sample_t s;
+  int64_t start, t;
+  gint v;
+  int i;
+
+  sample_init (&s, iterations);
+  start = now_us ();
+  for (i = 0; i < iterations; ++i)
+    {
+      t = now_us ();
+      if (!xcdbus_get_property_int (c, XENMGR_SERVICE, XENMGR_OBJ, XENMGR_INTERFACE,
+                                    BENCH_INT_PROPERTY, &v))
+        s.errors++;
+      s.us[s.n++] = now_us () - t;
+    }
+  s.elapsed_us = now_us () - start;
+  report ("property_get", &s);
+}
+
+static void
+bench_property_set (xcdbus_conn_t * c, int iterations)
+{
+  GValue v = { 0 };
+  sample_t s;
+  int64_t start, t;
+  int i;
+
+  g_value_init (&v, G_TYPE_INT);
+  sample_init (&s, iterations);
+  start = now_us ();
+  for (i = 0; i < iterations; ++i)
+    {
+      g_value_set_int (&v, i);
+      t = now_us ();
+      if (!xcdbus_set_property_var (c, XENMGR_SERVICE, XENMGR_OBJ, XENMGR_INTERFACE,
+                                    BENCH_INT_PROPERTY, &v))
+        s.errors++;
+      s.us[s.n++] = now_us () - t;
+    }
+  s.elapsed_us = now_us () - start;
+  g_value_unset (&v);
+  report ("property_set", &s);
+}
+
+static void
+bench_broadcast_signal (xcdbus_conn_t * c, int iterations)
+{
+  sample_t s;
+  int64_t start, t;
+  int i;
+
+  sample_init (&s, iterations);
+  start = now_us ();
+  for (i = 0; i < iterations; ++i)
+    {
+      t = now_us ();
+      if (!xcdbus_broadcast_signal (c, BENCH_OBJ, BENCH_INTERFACE, "broadcast", "bench"))
+        s.errors++;
+      s.us[s.n++] = now_us () - t;
+    }
+  s.elapsed_us = now_us () - start;
+  report ("broadcast_signal", &s);
+}
+
+/* time from the stand-in sending a tick to us seeing it */
+static DBusHandlerResult
+tick_filter (DBusConnection * conn, DBusMessage * m, void *data)
+{
+  dbus_int64_t sent;
+
+  if (!dbus_message_is_signal (m, BENCH_INTERFACE, BENCH_TICK_SIGNAL))
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+  if (ticks_seen < ticks_wanted &&
+      dbus_message_get_args (m, NULL, DBUS_TYPE_INT64, &sent, DBUS_TYPE_INVALID))
+    tick_us[ticks_seen++] = now_us () - sent;
+  return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+static void
+bench_signal_flood (xcdbus_conn_t * c, int iterations)
+{
+  DBusConnection *conn = xcdbus_get_dbus_connection (c);
+  const char *rule = "type='signal',interface='" BENCH_INTERFACE "',member='" BENCH_TICK_SIGNAL "'";
+  dbus_uint32_t count = iterations;
+  DBusMessage *m;
+  sample_t s;
+  int64_t start, last;
+  int seen;
+
+  dbus_bus_add_match (conn, rule, NULL);
+  dbus_connection_add_filter (conn, tick_filter, NULL, NULL);
+  sample_init (&s, iterations);
+  tick_us = s.us;
+  ticks_wanted = iterations;
+  ticks_seen = 0;
+
+  m = dbus_message_new_method_call (XENMGR_SERVICE, BENCH_OBJ, BENCH_INTERFACE, BENCH_FLOOD_METHOD);
+  dbus_message_append_args (m, DBUS_TYPE_UINT32, &count, DBUS_TYPE_INVALID);
+  dbus_message_set_no_reply (m, TRUE);
+  start = last = now_us ();
+  dbus_connection_send (conn, m, NULL);
+  dbus_connection_flush (conn);
+  dbus_message_unref (m);
+
+  for (seen = 0; ticks_seen < ticks_wanted;)
+    {
+      loop_once (c, 100);
+      if (ticks_seen != seen)
+        {
+          seen = ticks_seen;
+          last = now_us ();
+        }
+      else if (now_us () - last > FLOOD_IDLE_MS * 1000)
+        {
+          break;
+        }
+    }
+  s.n = ticks_seen;
+  s.errors = ticks_wanted - ticks_seen;
+  s.elapsed_us = last - start;
+
+  dbus_connection_remove_filter (conn, tick_filter, NULL);
+  dbus_bus_remove_match (conn, rule, NULL);
+  tick_us = NULL;
+  report ("signal_flood", &s);
+}
+
+static void
+usage (void)
+{
+  fprintf (stderr, "usage: xcdbus-bench [--backend select|event|glib] [--iterations N]\n"
+           "                    [--latency-us N] [--version STRING]\n");
+  exit (2);
+}
+
+int
+main (int argc, char *argv[])
+{
+  xcdbus_conn_t *c;
+  int iterations = 2000;
+  int i;
+
+  for (i = 1; i < argc; ++i)
+    {
+      if (i + 1 == argc)
+        usage ();
+      if (!strcmp (argv[i], "--backend"))
+        {
+          ++i;
+          if (!strcmp (argv[i], "select"))
+            backend = BACKEND_SELECT;
+          else if (!strcmp (argv[i], "event"))
+            backend = BACKEND_EVENT;
+          else if (!strcmp (argv[i], "glib"))
+            backend = BACKEND_GLIB;
+          else
+            usage ();
+        }
+      else if (!strcmp (argv[i], "--iterations"))
+        iterations = atoi (argv[++i]);
+      else if (!strcmp (argv[i], "--latency-us"))
+        latency_us = atoi (argv[++i]);
+      else if (!strcmp (argv[i], "--version"))
+        version = argv[++i];
+      else
+        usage ();
+    }
+  if (iterations <= 0)
+    usage ();
+
+  g_type_init ();
+#ifndef HAVE_LIBEVENT
+  if (backend == BACKEND_EVENT)
+    {
+      fprintf (stderr, "xcdbus-bench: built without libevent\n");
+      return EXIT_SKIP;
+    }
+#endif
+  c = bench_connect ();
+  if (!c)
+    {
+      fprintf (stderr, "xcdbus-bench: cannot connect to the bus\n");
+      return 1;
+    }
+  if (!wait_for_services (c))
+    return 1;
+
+  bench_read_db (c, iterations);
+  bench_write_db (c, iterations);
+  bench_property_get (c, iterations);
+  bench_property_set (c, iterations);
+  bench_broadcast_signal (c, iterations);
+  bench_signal_flood (c, iterations);
+
+  xcdbus_shutdown (c);
+  return 0;
+}
@@ -0,0 +1,35 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __BENCH_H__
+#define __BENCH_H__
+
+/* what xcdbus-bench and xcdbus-standin agree on besides the real services */
+
+/* properties of xenmgr's interface the stand-in has */
+#define BENCH_INT_PROPERTY    "bench-int"
+#define BENCH_STRING_PROPERTY "bench-string"
+
+/* flood(u count) has the stand-in emit count tick(x sent_us) signals,
+ * sent_us being CLOCK_MONOTONIC when sent */
+#define BENCH_OBJ          "/bench"
+#define BENCH_INTERFACE    "com.citrix.xenclient.bench"
+#define BENCH_FLOOD_METHOD "flood"
+#define BENCH_TICK_SIGNAL  "tick"
+
+#endif /* __BENCH_H__ */
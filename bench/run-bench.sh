@@ -0,0 +1,77 @@
+#!/bin/sh
+#
+# Copyright (c) 2012 Citrix Systems, Inc.
+# 
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2.1 of the License, or (at your option) any later version.
+# 
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+# 
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+#
+
+# starts a private dbus-daemon and xcdbus-standin, then runs xcdbus-bench
+# once per backend, appending its JSON lines to the output file
+
+CONFIG=bench-bus.conf.in
+LATENCY=0
+ITERATIONS=2000
+BACKENDS="select event glib"
+OUTPUT=bench-results.json
+
+while [ $# -gt 0 ]; do
+	case "$1" in
+	--config) CONFIG="$2"; shift ;;
+	--latency-us) LATENCY="$2"; shift ;;
+	--iterations) ITERATIONS="$2"; shift ;;
+	--backends) BACKENDS="$2"; shift ;;
+	--output) OUTPUT="$2"; shift ;;
+	*) echo "usage: $0 [--config FILE] [--latency-us N] [--iterations N] [--backends LIST] [--output FILE]" >&2
+	   exit 2 ;;
+	esac
+	shift
+done
+
+DIR=`mktemp -d /tmp/xcdbus-bench.XXXXXX` || exit 1
+BUS_PID=
+STANDIN_PID=
+
+cleanup () {
+	[ -n "${STANDIN_PID}" ] && kill ${STANDIN_PID} 2>/dev/null
+	[ -n "${BUS_PID}" ] && kill ${BUS_PID} 2>/dev/null
+	rm -rf "${DIR}"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+sed "s,@BENCH_DIR@,${DIR},g" < "${CONFIG}" > "${DIR}/bus.conf"
+dbus-daemon --config-file="${DIR}/bus.conf" --fork \
+	--print-address=3 --print-pid=4 3>"${DIR}/address" 4>"${DIR}/pid" || exit 1
+BUS_PID=`cat "${DIR}/pid"`
+DBUS_SYSTEM_BUS_ADDRESS=`cat "${DIR}/address"`
+export DBUS_SYSTEM_BUS_ADDRESS
+
+./xcdbus-standin --latency-us "${LATENCY}" &
+STANDIN_PID=$!
+
+STATUS=0
+for b in ${BACKENDS}; do
+	./xcdbus-bench --backend "$b" --iterations "${ITERATIONS}" \
+		--latency-us "${LATENCY}" --version "${VERSION}" >> "${DIR}/results"
+	case $? in
+	0) ;;
+	77) echo "skipping $b backend, not built in" >&2 ;;
+	*) echo "$b backend failed" >&2; STATUS=1 ;;
+	esac
+done
+
+# earlier runs stay in the output file, to compare against
+[ -f "${DIR}/results" ] && tee -a "${OUTPUT}" < "${DIR}/results"
+exit ${STATUS}
@@ -0,0 +1,329 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * stand-ins for the db, xenmgr and input daemons, answering just what the
+ * benchmarks ask for after an optional delay, on the bus named by
+ * DBUS_SYSTEM_BUS_ADDRESS. Also floods signals on request.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <time.h>
+#include <glib.h>
+#include <dbus/dbus.h>
+
+#include "bench.h"
+
+static const char *DB_SERVICE = "com.citrix.xenclient.db";
+static const char *DB_INTERFACE = "com.citrix.xenclient.db";
+static const char *XENMGR_SERVICE = "com.citrix.xenclient.xenmgr";
+static const char *XENMGR_INTERFACE = "com.citrix.xenclient.xenmgr";
+static const char *INPUT_SERVICE = "com.citrix.xenclient.input";
+static const char *INPUT_INTERFACE = "com.citrix.xenclient.input";
+static const char *PROPERTIES_INTERFACE = "org.freedesktop.DBus.Properties";
+
+/* delay before answering each call, us */
+static unsigned int latency_us = 0;
+/* path -> value */
+static GHashTable *db = NULL;
+static dbus_int32_t bench_int = 42;
+static char *bench_string = NULL;
+
+static int64_t
+now_us (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static DBusMessage *
+db_call (DBusMessage * m)
+{
+  const char *path, *value;
+  DBusMessage *reply;
+
+  if (dbus_message_is_method_call (m, DB_INTERFACE, "read") &&
+      dbus_message_get_args (m, NULL, DBUS_TYPE_STRING, &path, DBUS_TYPE_INVALID))
+    {
+      value = g_hash_table_lookup (db, path);
+      if (!value)
+        value = "";
+      reply = dbus_message_new_method_return (m);
+      dbus_message_append_args (reply, DBUS_TYPE_STRING, &value, DBUS_TYPE_INVALID);
+      return reply;
+    }
+  if (dbus_message_is_method_call (m, DB_INTERFACE, "write") &&
+      dbus_message_get_args (m, NULL, DBUS_TYPE_STRING, &path, DBUS_TYPE_STRING, &value,
+                             DBUS_TYPE_INVALID))
+    {
+      g_hash_table_replace (db, g_strdup (path), g_strdup (value));
+      return dbus_message_new_method_return (m);
+    }
+  return NULL;
+}
+
+/* append the value of a bench property as a variant */
+static int
+property_append (DBusMessageIter * iter, const char *name)
+{
+  DBusMessageIter var;
+
+  if (!strcmp (name, BENCH_INT_PROPERTY))
+    {
+      dbus_message_iter_open_container (iter, DBUS_TYPE_VARIANT, "i", &var);
+      dbus_message_iter_append_basic (&var, DBUS_TYPE_INT32, &bench_int);
+    }
+  else if (!strcmp (name, BENCH_STRING_PROPERTY))
+    {
+      dbus_message_iter_open_container (iter, DBUS_TYPE_VARIANT, "s", &var);
+      dbus_message_iter_append_basic (&var, DBUS_TYPE_STRING, &bench_string);
+    }
+  else
+    {
+      return 0;
+    }
+  dbus_message_iter_close_container (iter, &var);
+  return 1;
+}
+
+static DBusMessage *
+property_set (DBusMessage * m, const char *name, DBusMessageIter * iter)
+{
+  DBusMessageIter var;
+  int type;
+
+  dbus_message_iter_recurse (iter, &var);
+  type = dbus_message_iter_get_arg_type (&var);
+  if (!strcmp (name, BENCH_INT_PROPERTY) && type == DBUS_TYPE_INT32)
+    {
+      dbus_message_iter_get_basic (&var, &bench_int);
+    }
+  else if (!strcmp (name, BENCH_STRING_PROPERTY) && type == DBUS_TYPE_STRING)
+    {
+      const char *s;
+      dbus_message_iter_get_basic (&var, &s);
+      g_free (bench_string);
+      bench_string = g_strdup (s);
+    }
+  else
+    {
+      return dbus_message_new_error (m, DBUS_ERROR_INVALID_ARGS, "no such property");
+    }
+  return dbus_message_new_method_return (m);
+}
+
+/* org.freedesktop.DBus.Properties of xenmgr's interface */
+static DBusMessage *
+properties_call (DBusMessage * m)
+{
+  DBusMessageIter iter, array, entry;
+  const char *interface, *name;
+  DBusMessage *reply;
+
+  if (!dbus_message_iter_init (m, &iter) ||
+      dbus_message_iter_get_arg_type (&iter) != DBUS_TYPE_STRING)
+    return NULL;
+  dbus_message_iter_get_basic (&iter, &interface);
+  if (strcmp (interface, XENMGR_INTERFACE))
+    return dbus_message_new_error (m, DBUS_ERROR_INVALID_ARGS, "no such interface");
+  dbus_message_iter_next (&iter);
+
+  if (dbus_message_is_method_call (m, PROPERTIES_INTERFACE, "GetAll"))
+    {
+      static const char *names[] = { BENCH_INT_PROPERTY, BENCH_STRING_PROPERTY };
+      int i;
+
+      reply = dbus_message_new_method_return (m);
+      dbus_message_iter_init_append (reply, &iter);
+      dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY, "{sv}", &array);
+      for (i = 0; i < 2; ++i)
+        {
+          dbus_message_iter_open_container (&array, DBUS_TYPE_DICT_ENTRY, NULL, &entry);
+          dbus_message_iter_append_basic (&entry, DBUS_TYPE_STRING, &names[i]);
+          property_append (&entry, names[i]);
+          dbus_message_iter_close_container (&array, &entry);
+        }
+      dbus_message_iter_close_container (&iter, &array);
+      return reply;
+    }
+
+  if (dbus_message_iter_get_arg_type (&iter) != DBUS_TYPE_STRING)
+    return NULL;
+  dbus_message_iter_get_basic (&iter, &name);
+  dbus_message_iter_next (&iter);
+
+  if (dbus_message_is_method_call (m, PROPERTIES_INTERFACE, "Get"))
+    {
+      DBusMessageIter out;
+      reply = dbus_message_new_method_return (m);
+      dbus_message_iter_init_append (reply, &out);
+      if (!property_append (&out, name))
+        {
+          dbus_message_unref (reply);
+          return dbus_message_new_error (m, DBUS_ERROR_INVALID_ARGS, "no such property");
+        }
+      return reply;
+    }
+  if (dbus_message_is_method_call (m, PROPERTIES_INTERFACE, "Set") &&
+      dbus_message_iter_get_arg_type (&iter) == DBUS_TYPE_VARIANT)
+    return property_set (m, name, &iter);
+  return NULL;
+}
+
+static DBusMessage *
+xenmgr_call (DBusMessage * m)
+{
+  DBusMessage *reply;
+
+  if (dbus_message_is_method_call (m, XENMGR_INTERFACE, "list_domids"))
+    {
+      static const dbus_int32_t domids[] = { 0, 1, 2 };
+      const dbus_int32_t *p = domids;
+      reply = dbus_message_new_method_return (m);
+      dbus_message_append_args (reply, DBUS_TYPE_ARRAY, DBUS_TYPE_INT32, &p, 3,
+                                DBUS_TYPE_INVALID);
+      return reply;
+    }
+  if (!strcmp (dbus_message_get_interface (m) ? dbus_message_get_interface (m) : "",
+               PROPERTIES_INTERFACE))
+    return properties_call (m);
+  return NULL;
+}
+
+static DBusMessage *
+input_call (DBusMessage * m)
+{
+  DBusMessage *reply;
+  dbus_int32_t domid = 1;
+
+  if (!dbus_message_is_method_call (m, INPUT_INTERFACE, "get_focus_domid"))
+    return NULL;
+  reply = dbus_message_new_method_return (m);
+  dbus_message_append_args (reply, DBUS_TYPE_INT32, &domid, DBUS_TYPE_INVALID);
+  return reply;
+}
+
+/* answer first, so the signals are dispatched by the caller's main loop */
+static void
+flood (DBusConnection * conn, DBusMessage * m)
+{
+  dbus_uint32_t count, i;
+
+  if (!dbus_message_get_args (m, NULL, DBUS_TYPE_UINT32, &count, DBUS_TYPE_INVALID))
+    return;
+  if (!dbus_message_get_no_reply (m))
+    {
+      DBusMessage *reply = dbus_message_new_method_return (m);
+      dbus_connection_send (conn, reply, NULL);
+      dbus_message_unref (reply);
+    }
+  for (i = 0; i < count; ++i)
+    {
+      DBusMessage *sig = dbus_message_new_signal (BENCH_OBJ, BENCH_INTERFACE, BENCH_TICK_SIGNAL);
+      dbus_int64_t sent = now_us ();
+      dbus_message_append_args (sig, DBUS_TYPE_INT64, &sent, DBUS_TYPE_INVALID);
+      dbus_connection_send (conn, sig, NULL);
+      dbus_message_unref (sig);
+    }
+  dbus_connection_flush (conn);
+}
+
+static DBusHandlerResult
+filter (DBusConnection * conn, DBusMessage * m, void *data)
+{
+  const char *dest = dbus_message_get_destination (m);
+  DBusMessage *reply = NULL;
+
+  if (dbus_message_get_type (m) != DBUS_MESSAGE_TYPE_METHOD_CALL)
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+  if (dbus_message_is_method_call (m, BENCH_INTERFACE, BENCH_FLOOD_METHOD))
+    {
+      flood (conn, m);
+      return DBUS_HANDLER_RESULT_HANDLED;
+    }
+
+  if (latency_us)
+    usleep (latency_us);
+  if (!dest)
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+  if (!strcmp (dest, DB_SERVICE))
+    reply = db_call (m);
+  else if (!strcmp (dest, XENMGR_SERVICE))
+    reply = xenmgr_call (m);
+  else if (!strcmp (dest, INPUT_SERVICE))
+    reply = input_call (m);
+  if (!reply)
+    reply = dbus_message_new_error (m, DBUS_ERROR_UNKNOWN_METHOD, "not stood in for");
+  if (!dbus_message_get_no_reply (m))
+    dbus_connection_send (conn, reply, NULL);
+  dbus_message_unref (reply);
+  return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+static void
+usage (void)
+{
+  fprintf (stderr, "usage: xcdbus-standin [--latency-us N]\n");
+  exit (2);
+}
+
+int
+main (int argc, char *argv[])
+{
+  const char *names[] = { DB_SERVICE, XENMGR_SERVICE, INPUT_SERVICE };
+  DBusConnection *conn;
+  DBusError error;
+  int i;
+
+  for (i = 1; i < argc; ++i)
+    {
+      if (!strcmp (argv[i], "--latency-us") && i + 1 < argc)
+        latency_us = atoi (argv[++i]);
+      else
+        usage ();
+    }
+
+  dbus_error_init (&error);
+  conn = dbus_bus_get (DBUS_BUS_SYSTEM, &error);
+  if (!conn)
+    {
+      fprintf (stderr, "xcdbus-standin: %s\n", error.message);
+      return 1;
+    }
+  for (i = 0; i < 3; ++i)
+    {
+      if (dbus_bus_request_name (conn, names[i], DBUS_NAME_FLAG_DO_NOT_QUEUE, &error) !=
+          DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER)
+        {
+          fprintf (stderr, "xcdbus-standin: cannot own %s\n", names[i]);
+          return 1;
+        }
+    }
+  db = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  bench_string = g_strdup ("bench");
+  dbus_connection_add_filter (conn, filter, NULL, NULL);
+
+  while (dbus_connection_read_write_dispatch (conn, -1))
+    ;
+  return 0;
+}
@@ -0,0 +1,162 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ * 
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/* bounded, expiring cache of config database values keyed by path */
+
+#include "project.h"
+
+static char rcsid[] = "$Id:$";
+
+typedef struct dbentry {
+    struct xcdbus_dbcache *d;
+    char *path;
+    char *value;
+    /* xcdbus_now_ms() after which it is stale, 0 for never */
+    int64_t expires;
+    /* link in the lru queue */
+    GList *lru;
+} dbentry_t;
+
+struct xcdbus_dbcache {
+    GHashTable *entries;
+    GQueue lru;
+    unsigned int max;
+    int ttl;
+    unsigned long hits;
+    unsigned long misses;
+};
+
+static void
+entry_free (gpointer data)
+{
+  dbentry_t *e = (dbentry_t *) data;
+  g_queue_delete_link (&e->d->lru, e->lru);
+  xcdbus_xfree (e->path);
+  xcdbus_xfree (e->value);
+  xcdbus_xfree (e);
+}
+
+INTERNAL xcdbus_dbcache_t *
+xcdbus_dbcache_new (unsigned int max_entries, int ttl_ms)
+{
+  xcdbus_dbcache_t *d = xcdbus_xmalloc (sizeof (xcdbus_dbcache_t));
+  memset (d, 0, sizeof (*d));
+  d->entries = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, entry_free);
+  g_queue_init (&d->lru);
+  d->max = max_entries;
+  d->ttl = ttl_ms;
+  return d;
+}
+
+INTERNAL void
+xcdbus_dbcache_free (xcdbus_dbcache_t * d)
+{
+  if (!d)
+    return;
+  /* unlinks the lru queue as well */
+  g_hash_table_destroy (d->entries);
+  xcdbus_xfree (d);
+}
+
+/* cached value of path, NULL on miss; valid until the next store */
+INTERNAL const char *
+xcdbus_dbcache_lookup (xcdbus_dbcache_t * d, const char *path)
+{
+  dbentry_t *e = g_hash_table_lookup (d->entries, path);
+
+  if (e && e->expires && e->expires <= xcdbus_now_ms ())
+    {
+      g_hash_table_remove (d->entries, path);
+      e = NULL;
+    }
+  if (!e)
+    {
+      d->misses++;
+      return NULL;
+    }
+
+  d->hits++;
+  g_queue_unlink (&d->lru, e->lru);
+  g_queue_push_head_link (&d->lru, e->lru);
+  return e->value;
+}
+
+INTERNAL void
+xcdbus_dbcache_store (xcdbus_dbcache_t * d, const char *path, const char *value)
+{
+  dbentry_t *e = g_hash_table_lookup (d->entries, path);
+
+  if (e)
+    {
+      xcdbus_xfree (e->value);
+      g_queue_unlink (&d->lru, e->lru);
+      g_queue_push_head_link (&d->lru, e->lru);
+    }
+  else
+    {
+      e = xcdbus_xmalloc (sizeof (dbentry_t));
+      e->d = d;
+      e->path = strdup (path);
+      g_queue_push_head (&d->lru, e);
+      e->lru = d->lru.head;
+      g_hash_table_insert (d->entries, e->path, e);
+    }
+  e->value = strdup (value);
+  e->expires = d->ttl > 0 ? xcdbus_now_ms () + d->ttl : 0;
+
+  while (d->max && d->lru.length > d->max)
+    {
+      dbentry_t *old = (dbentry_t *) d->lru.tail->data;
+      g_hash_table_remove (d->entries, old->path);
+    }
+}
+
+static gboolean
+entry_under (gpointer key, gpointer value, gpointer prefix)
+{
+  const char *p = (const char *) prefix;
+  const char *k = (const char *) key;
+  size_t len = strlen (p);
+
+  if (strncmp (k, p, len))
+    return FALSE;
+  /* the node itself, or something below it */
+  return k[len] == 0 || k[len] == '/' || (len && p[len - 1] == '/');
+}
+
+/* forget path and the subtree below it, everything if path is NULL */
+INTERNAL void
+xcdbus_dbcache_invalidate (xcdbus_dbcache_t * d, const char *path)
+{
+  if (!path)
+    g_hash_table_remove_all (d->entries);
+  else
+    g_hash_table_foreach_remove (d->entries, entry_under, (gpointer) path);
+}
+
+INTERNAL void
+xcdbus_dbcache_stats (xcdbus_dbcache_t * d, unsigned long *hits, unsigned long *misses,
+                      unsigned int *entries)
+{
+  if (hits)
+    *hits = d->hits;
+  if (misses)
+    *misses = d->misses;
+  if (entries)
+    *entries = d->lru.length;
+}
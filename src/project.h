@@ -62,6 +62,16 @@
 #include <event.h>
 #endif
 
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#endif
+
+#ifdef HAVE_EXECINFO_H
+#include <execinfo.h>
+#endif
+
 #ifdef INT_PROTOS
 #define INTERNAL
 #define EXTERNAL
@@ -83,18 +93,57 @@
 
 typedef int xcdbus_fdcond_t;
 
+/* outcome of a call, for xcdbus_stats_record */
+#define XCDBUS_STATS_OK      0
+#define XCDBUS_STATS_ERROR   1
+#define XCDBUS_STATS_TIMEOUT 2
+
 struct xcdbus_conn;
 
 typedef struct {
     int fd;
     xcdbus_fdcond_t cond;
-    DBusWatch *dbw;
+    /* enabled libdbus watches on this fd */
+    DBusWatch *rdw;
+    DBusWatch *wrw;
     struct xcdbus_conn *c;
 #ifdef HAVE_LIBEVENT
     struct event ev;
+    int ev_added;
+#endif
+#ifdef HAVE_SYS_EPOLL_H
+    /* conditions currently registered with the epoll set */
+    xcdbus_fdcond_t epoll_cond;
 #endif
 } xcdbus_watch_t;
 
+typedef struct {
+    DBusTimeout *t;
+    /* xcdbus_now_ms() at which it fires */
+    int64_t deadline;
+    /* position in the timer heap, -1 when not armed */
+    int index;
+    /* internal one-shot timers have no DBusTimeout but a function */
+    void (*fn)(void *data);
+    void *data;
+    /* glib backend: the source running fn */
+    GSource *source;
+    /* being handled with the loop lock dropped, and libdbus let go of it
+     * meanwhile: whoever handles it frees it */
+    int firing;
+    int dead;
+} xcdbus_timeout_t;
+
+typedef struct {
+    xcdbus_timeout_t **v;
+    int n;
+    int size;
+} xcdbus_timerheap_t;
+
+typedef struct xcdbus_dbcache xcdbus_dbcache_t;
+
+typedef struct xcdbus_ring xcdbus_ring_t;
+
 #include "prototypes.h"
 
 #endif /* __PROJECT_H__ */
@@ -0,0 +1,472 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/* property sets as returned by org.freedesktop.DBus.Properties.GetAll */
+
+#include "project.h"
+
+static char rcsid[] = "$Id:$";
+
+typedef struct propentry {
+    const char *name;
+    /* DBUS_TYPE_*, 16 bit integers are widened like dbus-glib does, and
+     * DBUS_TYPE_INVALID for variants we have no accessor for */
+    int type;
+    union {
+        dbus_bool_t b;
+        unsigned char y;
+        dbus_int32_t i;
+        dbus_uint32_t u;
+        dbus_int64_t x;
+        dbus_uint64_t t;
+        double d;
+        const char *s;
+    } v;
+} propentry_t;
+
+/* one block: this header, entries sorted by name, then their strings */
+struct xcdbus_props {
+    int n;
+    propentry_t e[1];
+};
+
+static const char *
+strings_add (char **strings, const char *s)
+{
+  char *r = *strings;
+  size_t len = strlen (s) + 1;
+  memcpy (r, s, len);
+  *strings += len;
+  return r;
+}
+
+/* value of a variant into e, any string it holds stored at *strings */
+static void
+entry_of_variant (propentry_t * e, DBusMessageIter * var, char **strings)
+{
+  e->type = dbus_message_iter_get_arg_type (var);
+  switch (e->type)
+    {
+    case DBUS_TYPE_INT16:
+      {
+        dbus_int16_t v;
+        dbus_message_iter_get_basic (var, &v);
+        e->type = DBUS_TYPE_INT32;
+        e->v.i = v;
+        break;
+      }
+    case DBUS_TYPE_UINT16:
+      {
+        dbus_uint16_t v;
+        dbus_message_iter_get_basic (var, &v);
+        e->type = DBUS_TYPE_UINT32;
+        e->v.u = v;
+        break;
+      }
+    case DBUS_TYPE_BOOLEAN:
+      dbus_message_iter_get_basic (var, &e->v.b);
+      break;
+    case DBUS_TYPE_BYTE:
+      dbus_message_iter_get_basic (var, &e->v.y);
+      break;
+    case DBUS_TYPE_INT32:
+      dbus_message_iter_get_basic (var, &e->v.i);
+      break;
+    case DBUS_TYPE_UINT32:
+      dbus_message_iter_get_basic (var, &e->v.u);
+      break;
+    case DBUS_TYPE_INT64:
+      dbus_message_iter_get_basic (var, &e->v.x);
+      break;
+    case DBUS_TYPE_UINT64:
+      dbus_message_iter_get_basic (var, &e->v.t);
+      break;
+    case DBUS_TYPE_DOUBLE:
+      dbus_message_iter_get_basic (var, &e->v.d);
+      break;
+    case DBUS_TYPE_STRING:
+    case DBUS_TYPE_OBJECT_PATH:
+      {
+        const char *s;
+        dbus_message_iter_get_basic (var, &s);
+        e->v.s = strings_add (strings, s);
+        break;
+      }
+    default:
+      e->type = DBUS_TYPE_INVALID;
+      break;
+    }
+}
+
+/* string bytes entry_of_variant will need */
+static size_t
+variant_bytes (DBusMessageIter * var)
+{
+  int type = dbus_message_iter_get_arg_type (var);
+  const char *s;
+
+  if (type != DBUS_TYPE_STRING && type != DBUS_TYPE_OBJECT_PATH)
+    return 0;
+  dbus_message_iter_get_basic (var, &s);
+  return strlen (s) + 1;
+}
+
+/* counts entries and their string bytes when p is NULL, fills p otherwise */
+static int
+props_walk (DBusMessageIter * array, xcdbus_props_t * p, char *strings, size_t * bytes)
+{
+  DBusMessageIter dict, entry, var;
+  int n = 0;
+
+  dbus_message_iter_recurse (array, &dict);
+  for (; dbus_message_iter_get_arg_type (&dict) == DBUS_TYPE_DICT_ENTRY;
+       dbus_message_iter_next (&dict))
+    {
+      const char *name;
+      propentry_t *e;
+
+      dbus_message_iter_recurse (&dict, &entry);
+      dbus_message_iter_get_basic (&entry, &name);
+      dbus_message_iter_next (&entry);
+      dbus_message_iter_recurse (&entry, &var);
+
+      if (!p)
+        {
+          *bytes += strlen (name) + 1 + variant_bytes (&var);
+          ++n;
+          continue;
+        }
+
+      e = &p->e[n++];
+      e->name = strings_add (&strings, name);
+      entry_of_variant (e, &var, &strings);
+    }
+  return n;
+}
+
+static int
+entry_cmp (const void *a, const void *b)
+{
+  return strcmp (((const propentry_t *) a)->name, ((const propentry_t *) b)->name);
+}
+
+static size_t
+props_head (int n)
+{
+  return sizeof (xcdbus_props_t) + (n ? n - 1 : 0) * sizeof (propentry_t);
+}
+
+static xcdbus_props_t *
+props_of_iter (DBusMessageIter * array)
+{
+  xcdbus_props_t *p;
+  size_t bytes = 0;
+  int n;
+
+  n = props_walk (array, NULL, NULL, &bytes);
+  p = xcdbus_xmalloc (props_head (n) + bytes);
+  p->n = n;
+  props_walk (array, p, (char *) p + props_head (n), NULL);
+  qsort (p->e, n, sizeof (propentry_t), entry_cmp);
+  return p;
+}
+
+/* property set of a GetAll reply, NULL if it is an error or malformed */
+INTERNAL xcdbus_props_t *
+xcdbus_props_of_reply (DBusMessage * reply)
+{
+  DBusMessageIter iter;
+
+  if (!reply || dbus_message_get_type (reply) != DBUS_MESSAGE_TYPE_METHOD_RETURN)
+    return NULL;
+  if (!dbus_message_has_signature (reply, "a{sv}"))
+    return NULL;
+  dbus_message_iter_init (reply, &iter);
+  return props_of_iter (&iter);
+}
+
+/* one property set of a Properties.Get reply for property, NULL if it is
+ * an error or malformed */
+INTERNAL xcdbus_props_t *
+xcdbus_props_of_get_reply (DBusMessage * reply, const char *property)
+{
+  DBusMessageIter iter, var;
+  xcdbus_props_t *p;
+  char *strings;
+
+  if (!reply || dbus_message_get_type (reply) != DBUS_MESSAGE_TYPE_METHOD_RETURN)
+    return NULL;
+  if (!dbus_message_has_signature (reply, "v"))
+    return NULL;
+  dbus_message_iter_init (reply, &iter);
+  dbus_message_iter_recurse (&iter, &var);
+
+  p = xcdbus_xmalloc (props_head (1) + strlen (property) + 1 + variant_bytes (&var));
+  p->n = 1;
+  strings = (char *) p + props_head (1);
+  p->e[0].name = strings_add (&strings, property);
+  entry_of_variant (&p->e[0], &var, &strings);
+  return p;
+}
+
+static const propentry_t *
+props_find (const xcdbus_props_t * p, const char *property)
+{
+  propentry_t key;
+
+  if (!p)
+    return NULL;
+  key.name = property;
+  return bsearch (&key, p->e, p->n, sizeof (propentry_t), entry_cmp);
+}
+
+static size_t
+entry_bytes (const propentry_t * e)
+{
+  size_t bytes = strlen (e->name) + 1;
+  if (e->type == DBUS_TYPE_STRING || e->type == DBUS_TYPE_OBJECT_PATH)
+    bytes += strlen (e->v.s) + 1;
+  return bytes;
+}
+
+static void
+entry_copy (propentry_t * dst, const propentry_t * src, char **strings)
+{
+  *dst = *src;
+  dst->name = strings_add (strings, src->name);
+  if (src->type == DBUS_TYPE_STRING || src->type == DBUS_TYPE_OBJECT_PATH)
+    dst->v.s = strings_add (strings, src->v.s);
+}
+
+/* whether an entry survives a PropertiesChanged */
+static int
+entry_kept (const propentry_t * e, const xcdbus_props_t * changed, DBusMessageIter * invalidated)
+{
+  DBusMessageIter names;
+
+  if (props_find (changed, e->name))
+    return 0;
+  dbus_message_iter_recurse (invalidated, &names);
+  for (; dbus_message_iter_get_arg_type (&names) == DBUS_TYPE_STRING;
+       dbus_message_iter_next (&names))
+    {
+      const char *name;
+      dbus_message_iter_get_basic (&names, &name);
+      if (!strcmp (name, e->name))
+        return 0;
+    }
+  return 1;
+}
+
+/*
+ * old with a PropertiesChanged signal applied, as a new set. Invalidated
+ * properties are left out. NULL if the signal is malformed.
+ */
+INTERNAL xcdbus_props_t *
+xcdbus_props_update (const xcdbus_props_t * old, DBusMessage * signal)
+{
+  DBusMessageIter iter, invalidated;
+  xcdbus_props_t *changed, *p;
+  size_t bytes = 0;
+  char *strings;
+  int n, i, j = 0;
+
+  if (!dbus_message_has_signature (signal, "sa{sv}as"))
+    return NULL;
+  dbus_message_iter_init (signal, &iter);
+  dbus_message_iter_next (&iter);
+  changed = props_of_iter (&iter);
+  invalidated = iter;
+  dbus_message_iter_next (&invalidated);
+
+  n = changed->n;
+  for (i = 0; i < changed->n; ++i)
+    bytes += entry_bytes (&changed->e[i]);
+  for (i = 0; i < old->n; ++i)
+    if (entry_kept (&old->e[i], changed, &invalidated))
+      {
+        ++n;
+        bytes += entry_bytes (&old->e[i]);
+      }
+
+  p = xcdbus_xmalloc (props_head (n) + bytes);
+  p->n = n;
+  strings = (char *) p + props_head (n);
+  for (i = 0; i < changed->n; ++i)
+    entry_copy (&p->e[j++], &changed->e[i], &strings);
+  for (i = 0; i < old->n; ++i)
+    if (entry_kept (&old->e[i], changed, &invalidated))
+      entry_copy (&p->e[j++], &old->e[i], &strings);
+  qsort (p->e, n, sizeof (propentry_t), entry_cmp);
+
+  xcdbus_xfree (changed);
+  return p;
+}
+
+EXTERNAL void
+xcdbus_props_free (xcdbus_props_t * p)
+{
+  if (p)
+    xcdbus_xfree (p);
+}
+
+EXTERNAL int
+xcdbus_props_count (const xcdbus_props_t * p)
+{
+  return p ? p->n : 0;
+}
+
+/* name of property i, in sorted order, for iterating over a set */
+EXTERNAL const char *
+xcdbus_props_name (const xcdbus_props_t * p, int i)
+{
+  if (!p || i < 0 || i >= p->n)
+    return NULL;
+  return p->e[i].name;
+}
+
+/* string property without copying, valid as long as p */
+EXTERNAL const char *
+xcdbus_props_peek_string (const xcdbus_props_t * p, const char *property)
+{
+  const propentry_t *e = props_find (p, property);
+  if (!e || e->type != DBUS_TYPE_STRING)
+    return NULL;
+  return e->v.s;
+}
+
+/*
+ * property as the GValue org.freedesktop.DBus.Properties.Get would give
+ * through dbus-glib, to be released with g_value_unset. 0 if it is missing
+ * or of a type not kept in a set.
+ */
+EXTERNAL int
+xcdbus_props_get_value (const xcdbus_props_t * p, const char *property, GValue * outv)
+{
+  const propentry_t *e = props_find (p, property);
+  GValue v = { 0, };
+
+  if (!e)
+    return 0;
+  switch (e->type)
+    {
+    case DBUS_TYPE_BOOLEAN:
+      g_value_init (&v, G_TYPE_BOOLEAN);
+      g_value_set_boolean (&v, e->v.b);
+      break;
+    case DBUS_TYPE_BYTE:
+      g_value_init (&v, G_TYPE_UCHAR);
+      g_value_set_uchar (&v, e->v.y);
+      break;
+    case DBUS_TYPE_INT32:
+      g_value_init (&v, G_TYPE_INT);
+      g_value_set_int (&v, e->v.i);
+      break;
+    case DBUS_TYPE_UINT32:
+      g_value_init (&v, G_TYPE_UINT);
+      g_value_set_uint (&v, e->v.u);
+      break;
+    case DBUS_TYPE_INT64:
+      g_value_init (&v, G_TYPE_INT64);
+      g_value_set_int64 (&v, e->v.x);
+      break;
+    case DBUS_TYPE_UINT64:
+      g_value_init (&v, G_TYPE_UINT64);
+      g_value_set_uint64 (&v, e->v.t);
+      break;
+    case DBUS_TYPE_DOUBLE:
+      g_value_init (&v, G_TYPE_DOUBLE);
+      g_value_set_double (&v, e->v.d);
+      break;
+    case DBUS_TYPE_STRING:
+      g_value_init (&v, G_TYPE_STRING);
+      g_value_set_string (&v, e->v.s);
+      break;
+    case DBUS_TYPE_OBJECT_PATH:
+      g_value_init (&v, DBUS_TYPE_G_OBJECT_PATH);
+      g_value_set_boxed (&v, e->v.s);
+      break;
+    default:
+      return 0;
+    }
+  *outv = v;
+  return 1;
+}
+
+/* property of basic type into storage of that libdbus type, 0 if not one */
+INTERNAL int
+xcdbus_props_get_basic (const xcdbus_props_t * p, const char *property, int type, void *out)
+{
+  const propentry_t *e = props_find (p, property);
+
+  if (!e || e->type != type)
+    return 0;
+  switch (type)
+    {
+    case DBUS_TYPE_BYTE:
+      *(unsigned char *) out = e->v.y;
+      break;
+    case DBUS_TYPE_BOOLEAN:
+    case DBUS_TYPE_INT32:
+    case DBUS_TYPE_UINT32:
+      memcpy (out, &e->v, sizeof (dbus_uint32_t));
+      break;
+    case DBUS_TYPE_INT64:
+    case DBUS_TYPE_UINT64:
+    case DBUS_TYPE_DOUBLE:
+      memcpy (out, &e->v, sizeof (dbus_uint64_t));
+      break;
+    default:
+      return 0;
+    }
+  return 1;
+}
+
+/* same types accepted as the matching xcdbus_get_property_* */
+#define stub_props_get(name, typ, dtyp, field) \
+int \
+xcdbus_props_get_##name ( \
+    const xcdbus_props_t *p, \
+    const char *property, \
+    typ *outv) \
+{ \
+    const propentry_t *e = props_find (p, property); \
+    if (!e || e->type != dtyp) { \
+        return 0; \
+    } \
+    *outv = e->v.field; \
+    return 1; \
+}
+
+EXTERNAL int
+xcdbus_props_get_string (const xcdbus_props_t * p, const char *property, char **outv)
+{
+  const char *s = xcdbus_props_peek_string (p, property);
+  if (!s)
+    return 0;
+  *outv = strdup (s);
+  return 1;
+}
+
+EXTERNAL stub_props_get(bool, gboolean, DBUS_TYPE_BOOLEAN, b);
+EXTERNAL stub_props_get(int, gint, DBUS_TYPE_INT32, i);
+EXTERNAL stub_props_get(uint, guint, DBUS_TYPE_UINT32, u);
+EXTERNAL stub_props_get(int64, gint64, DBUS_TYPE_INT64, x);
+EXTERNAL stub_props_get(uint64, guint64, DBUS_TYPE_UINT64, t);
+EXTERNAL stub_props_get(double, gdouble, DBUS_TYPE_DOUBLE, d);
+EXTERNAL stub_props_get(byte, unsigned char, DBUS_TYPE_BYTE, y);
@@ -22,28 +22,76 @@ xcdbus_conn_t *xcdbus_init(const char *service_name);
 xcdbus_conn_t *xcdbus_init2(const char *service_name, DBusGConnection *connG);
 xcdbus_conn_t *xcdbus_init_with_gloop(const char *service_name, DBusGConnection *conn, GMainLoop *loop);
 xcdbus_conn_t *xcdbus_init_event(const char *service_name, DBusGConnection *connG);
+xcdbus_conn_t *xcdbus_init_epoll(const char *service_name, DBusGConnection *connG);
+int xcdbus_get_epoll_fd(xcdbus_conn_t *c);
+void xcdbus_process_epoll(xcdbus_conn_t *c);
+xcdbus_conn_t *xcdbus_init_threaded(const char *service_name);
+DBusMessage *xcdbus_threaded_receive(xcdbus_conn_t *c, int timeout_ms);
+void xcdbus_threaded_wakeup(xcdbus_conn_t *c);
+int xcdbus_threaded_send(xcdbus_conn_t *c, DBusMessage *msg);
 DBusGConnection *xcdbus_get_dbus_glib_connection(xcdbus_conn_t *c);
 DBusConnection *xcdbus_get_dbus_connection(xcdbus_conn_t *c);
+int xcdbus_set_connection_pool(xcdbus_conn_t *c, int n);
+int xcdbus_get_connection_pool_inflight(xcdbus_conn_t *c, int *inflight, int max);
 void xcdbus_shutdown(xcdbus_conn_t *c);
 int xcdbus_name_has_owner(xcdbus_conn_t *c, const char *service);
+void xcdbus_track_name_owner(xcdbus_conn_t *c, const char *service);
 void xcdbus_wait_service(xcdbus_conn_t *c, const char *service);
+int xcdbus_wait_service_timeout(xcdbus_conn_t *c, const char *service, int timeout_ms);
+void xcdbus_wait_service_async(xcdbus_conn_t *c, const char *service, int timeout_ms, xcdbus_service_cb cb, void *priv);
 int xcdbus_broadcast_signal(xcdbus_conn_t *c, const char *object_path, const char *interface, const char *member, const char *data);
+int xcdbus_broadcast_signal_args(xcdbus_conn_t *c, const char *object_path, const char *interface, const char *member, int first_arg_type, ...);
+void xcdbus_set_signal_batching(xcdbus_conn_t *c, int enable);
+void xcdbus_flush(xcdbus_conn_t *c);
+long xcdbus_get_outgoing_size(xcdbus_conn_t *c);
+int xcdbus_get_batched_signals(xcdbus_conn_t *c);
 const char *xcdbus_get_sender(xcdbus_conn_t *xc);
 int32_t xcdbus_get_sender_domid(xcdbus_conn_t *xc);
+xcdbus_msg_ctx_t *xcdbus_get_msg_ctx(xcdbus_conn_t *xc);
+xcdbus_msg_ctx_t *xcdbus_msg_ctx_ref(xcdbus_msg_ctx_t *ctx);
+void xcdbus_msg_ctx_unref(xcdbus_msg_ctx_t *ctx);
+const char *xcdbus_msg_ctx_sender(xcdbus_msg_ctx_t *ctx);
+dbus_uint32_t xcdbus_msg_ctx_serial(xcdbus_msg_ctx_t *ctx);
+int32_t xcdbus_msg_ctx_domid(xcdbus_msg_ctx_t *ctx);
+void xcdbus_set_domid_prefetch(xcdbus_conn_t *xc, int enable);
+int xcdbus_dispatch_budget(xcdbus_conn_t *xc, unsigned int max_messages, unsigned int max_us);
 int xcdbus_dispatch(xcdbus_conn_t *xc);
+void xcdbus_set_dispatch_budget(xcdbus_conn_t *xc, unsigned int max_messages, unsigned int max_us);
+void xcdbus_get_dispatch_stats(xcdbus_conn_t *xc, xcdbus_dispatch_stats_t *stats);
+void xcdbus_reset_dispatch_stats(xcdbus_conn_t *xc);
+void xcdbus_set_stall_watch(xcdbus_conn_t *xc, unsigned int stall_ms, xcdbus_stall_cb cb, void *priv);
+int xcdbus_export_stats(xcdbus_conn_t *xc, const char *objpath);
 int xcdbus_pre_select(xcdbus_conn_t *c, int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds);
 void xcdbus_post_select(xcdbus_conn_t *c, int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds);
+int xcdbus_next_timeout(xcdbus_conn_t *c);
+int xcdbus_pre_poll(xcdbus_conn_t *c, struct pollfd *fds, int nfds, int *timeout);
+void xcdbus_post_poll(xcdbus_conn_t *c, struct pollfd *fds, int nfds);
 int xcdbus_db_daemon_online(xcdbus_conn_t *conn);
 int xcdbus_read_db(xcdbus_conn_t *c, const char *path, char *buf, int buf_size);
 int xcdbus_write_db(xcdbus_conn_t *c, const char *path, const char *value);
+int xcdbus_read_db_async(xcdbus_conn_t *c, const char *path, xcdbus_db_read_cb cb, void *priv);
+int xcdbus_write_db_async(xcdbus_conn_t *c, const char *path, const char *value, xcdbus_db_write_cb cb, void *priv);
+xcdbus_db_values_t *xcdbus_read_db_many(xcdbus_conn_t *c, const char **paths, int n, size_t max_value_len);
+const char *xcdbus_db_value(const xcdbus_db_values_t *vals, int i);
+void xcdbus_db_cache_enable(xcdbus_conn_t *c, unsigned int max_entries, int ttl_ms);
+void xcdbus_db_cache_disable(xcdbus_conn_t *c);
+void xcdbus_db_cache_invalidate(xcdbus_conn_t *c, const char *path);
+int xcdbus_db_cache_stats(xcdbus_conn_t *c, unsigned long *hits, unsigned long *misses, unsigned int *entries);
+int xcdbus_db_pending(xcdbus_conn_t *c);
 int xcdbus_xenmgr_online(xcdbus_conn_t *c);
 int xcdbus_xenmgr_list_domids(xcdbus_conn_t *c, int32_t *out_domids, size_t out_domids_bufsz, int *out_num_domains);
+void xcdbus_xenmgr_track_domids(xcdbus_conn_t *c, xcdbus_domain_cb cb, void *priv);
+int xcdbus_xenmgr_has_domid(xcdbus_conn_t *c, int32_t domid);
+int32_t *xcdbus_xenmgr_get_domids(xcdbus_conn_t *c, int *n);
 int xcdbus_input_online(xcdbus_conn_t *conn);
+void xcdbus_input_track_focus(xcdbus_conn_t *c, xcdbus_focus_cb cb, void *priv);
 int xcdbus_input_get_focus_domid(xcdbus_conn_t *c, int32_t *out_domid);
 int xcdbus_merge_fds(xcdbus_conn_t *c, int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds);
 void xcdbus_process_fds(xcdbus_conn_t *c, int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds);
 void xcdbus_free(xcdbus_conn_t *c);
 DBusGProxy *xcdbus_get_proxy(xcdbus_conn_t *c, const char *service, const char *objpath, const char *interface);
+int xcdbus_mirror_properties(xcdbus_conn_t *c, const char *service, const char *objpath, const char *interface, xcdbus_prop_changed_cb cb, void *priv);
+void xcdbus_unmirror_properties(xcdbus_conn_t *c, const char *service, const char *objpath, const char *interface);
 int xcdbus_get_property_var(xcdbus_conn_t *c, const char *service, const char *objpath, const char *interface, const char *property, GValue *outv);
 int xcdbus_set_property_var(xcdbus_conn_t *c, const char *service, const char *objpath, const char *interface, const char *property, GValue *inpv);
 int xcdbus_get_property_string(xcdbus_conn_t *c, const char *service, const char *objpath, const char *interface, const char *property, char **outv);
@@ -62,9 +110,75 @@ int xcdbus_get_property_double(xcdbus_conn_t *c, const char *service, const char
 int xcdbus_set_property_double(xcdbus_conn_t *c, const char *service, const char *objpath, const char *interface, const char *property, gdouble inpv);
 int xcdbus_get_property_byte(xcdbus_conn_t *c, const char *service, const char *objpath, const char *interface, const char *property, unsigned char *outv);
 int xcdbus_set_property_byte(xcdbus_conn_t *c, const char *service, const char *objpath, const char *interface, const char *property, unsigned char inpv);
+int xcdbus_get_all_properties_many(xcdbus_conn_t *c, const char *service, const char **objpaths, int n, const char *interface, xcdbus_props_t **out);
+xcdbus_props_t *xcdbus_get_all_properties(xcdbus_conn_t *c, const char *service, const char *objpath, const char *interface);
+int xcdbus_get_all_properties_async(xcdbus_conn_t *c, const char *service, const char *objpath, const char *interface, xcdbus_props_cb cb, void *priv);
+int xcdbus_get_property_string_buf(xcdbus_conn_t *c, const char *service, const char *objpath, const char *interface, const char *property, char *buf, int buf_size);
 /* version.c */
 char *xcdbus_get_version(void);
 /* util.c */
 void *xcdbus_xmalloc(size_t s);
 void *xcdbus_xrealloc(void *p, size_t s);
 void *xcdbus_xfree(void *p);
+/* timeout.c */
+int64_t xcdbus_now_ms(void);
+int64_t xcdbus_now_us(void);
+void xcdbus_timerheap_insert(xcdbus_timerheap_t *h, xcdbus_timeout_t *t);
+void xcdbus_timerheap_remove(xcdbus_timerheap_t *h, xcdbus_timeout_t *t);
+xcdbus_timeout_t *xcdbus_timerheap_top(xcdbus_timerheap_t *h);
+void xcdbus_timerheap_free(xcdbus_timerheap_t *h);
+/* dbcache.c */
+xcdbus_dbcache_t *xcdbus_dbcache_new(unsigned int max_entries, int ttl_ms);
+void xcdbus_dbcache_free(xcdbus_dbcache_t *d);
+const char *xcdbus_dbcache_lookup(xcdbus_dbcache_t *d, const char *path);
+void xcdbus_dbcache_store(xcdbus_dbcache_t *d, const char *path, const char *value);
+void xcdbus_dbcache_invalidate(xcdbus_dbcache_t *d, const char *path);
+void xcdbus_dbcache_stats(xcdbus_dbcache_t *d, unsigned long *hits, unsigned long *misses, unsigned int *entries);
+/* props.c */
+xcdbus_props_t *xcdbus_props_of_reply(DBusMessage *reply);
+xcdbus_props_t *xcdbus_props_of_get_reply(DBusMessage *reply, const char *property);
+xcdbus_props_t *xcdbus_props_update(const xcdbus_props_t *old, DBusMessage *signal);
+void xcdbus_props_free(xcdbus_props_t *p);
+int xcdbus_props_count(const xcdbus_props_t *p);
+const char *xcdbus_props_name(const xcdbus_props_t *p, int i);
+const char *xcdbus_props_peek_string(const xcdbus_props_t *p, const char *property);
+int xcdbus_props_get_value(const xcdbus_props_t *p, const char *property, GValue *outv);
+int xcdbus_props_get_basic(const xcdbus_props_t *p, const char *property, int type, void *out);
+int xcdbus_props_get_string(const xcdbus_props_t *p, const char *property, char **outv);
+int xcdbus_props_get_bool(const xcdbus_props_t *p, const char *property, gboolean *outv);
+int xcdbus_props_get_int(const xcdbus_props_t *p, const char *property, gint *outv);
+int xcdbus_props_get_uint(const xcdbus_props_t *p, const char *property, guint *outv);
+int xcdbus_props_get_int64(const xcdbus_props_t *p, const char *property, gint64 *outv);
+int xcdbus_props_get_uint64(const xcdbus_props_t *p, const char *property, guint64 *outv);
+int xcdbus_props_get_double(const xcdbus_props_t *p, const char *property, gdouble *outv);
+int xcdbus_props_get_byte(const xcdbus_props_t *p, const char *property, unsigned char *outv);
+/* threads.c */
+void xcdbus_thread_init(void);
+int xcdbus_thread_safe(void);
+void xcdbus_registry_lock(void);
+void xcdbus_registry_unlock(void);
+void xcdbus_loop_lock(void);
+void xcdbus_loop_unlock(void);
+int xcdbus_read_begin(void);
+void xcdbus_read_end(int e);
+void xcdbus_retire(void (*fn)(void *), void *p);
+/* ring.c */
+xcdbus_ring_t *xcdbus_ring_new(unsigned int size, int polled);
+void xcdbus_ring_free(xcdbus_ring_t *r);
+void xcdbus_ring_kick(xcdbus_ring_t *r);
+int xcdbus_ring_push(xcdbus_ring_t *r, void *p);
+void *xcdbus_ring_pop(xcdbus_ring_t *r);
+int xcdbus_ring_fd(xcdbus_ring_t *r);
+void xcdbus_ring_drain(xcdbus_ring_t *r);
+void *xcdbus_ring_wait(xcdbus_ring_t *r, int timeout_ms);
+/* stats.c */
+void xcdbus_enable_stats(int on);
+int xcdbus_stats_enabled(void);
+void xcdbus_enable_stats_bytes(int on);
+void xcdbus_stats_thread_init(void);
+size_t xcdbus_stats_message_bytes(DBusMessage *m);
+void xcdbus_stats_record(const char *destination, const char *method, int64_t us, int outcome, size_t bytes_out, size_t bytes_in);
+void xcdbus_stats_stall(const char *destination, const char *method);
+xcdbus_stats_t *xcdbus_get_stats(void);
+void xcdbus_reset_stats(void);
+DBusHandlerResult xcdbus_stats_object_message(DBusConnection *conn, DBusMessage *m, void *data);
@@ -0,0 +1,295 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * bounded lock-free queue of pointers, after Dmitry Vyukov's bounded MPMC
+ * queue. Consumers sleep while it is empty in one of two ways, chosen when
+ * it is made: a polled ring has a pipe made readable by every push, for a
+ * single consumer polling xcdbus_ring_fd under any number of producers;
+ * otherwise a count of items and one of wakeups under a condition lets any
+ * number of consumers sleep in xcdbus_ring_wait.
+ */
+
+#include "project.h"
+#include <fcntl.h>
+#include <errno.h>
+
+static char rcsid[] = "$Id:$";
+
+typedef struct cell {
+    /* position it can be filled at, or position + 1 once filled */
+    volatile gint seq;
+    void *data;
+} cell_t;
+
+struct xcdbus_ring {
+    cell_t *cells;
+    guint mask;
+    /* next position to fill, and to take */
+    volatile gint head;
+    volatile gint tail;
+    /* polled: the pipe, -1 otherwise */
+    int fds[2];
+    /* waited: items no sleeper has claimed yet, and wakeups, under lock */
+    guint items;
+    guint wakeups;
+#if GLIB_CHECK_VERSION(2,32,0)
+    GMutex lock;
+    GCond cond;
+#else
+    GMutex *lock;
+    GCond *cond;
+#endif
+};
+
+#if GLIB_CHECK_VERSION(2,32,0)
+#define RING_LOCK(r)   g_mutex_lock (&(r)->lock)
+#define RING_UNLOCK(r) g_mutex_unlock (&(r)->lock)
+#define RING_SIGNAL(r) g_cond_signal (&(r)->cond)
+#else
+#define RING_LOCK(r)   g_mutex_lock ((r)->lock)
+#define RING_UNLOCK(r) g_mutex_unlock ((r)->lock)
+#define RING_SIGNAL(r) g_cond_signal ((r)->cond)
+#endif
+
+/*
+ * size is rounded up to a power of two; polled picks xcdbus_ring_fd over
+ * xcdbus_ring_wait. NULL if the pipe cannot be made.
+ */
+INTERNAL xcdbus_ring_t *
+xcdbus_ring_new (unsigned int size, int polled)
+{
+  xcdbus_ring_t *r;
+  guint n = 2, i;
+
+  while (n < size)
+    n <<= 1;
+  r = xcdbus_xmalloc (sizeof (xcdbus_ring_t));
+  memset (r, 0, sizeof (*r));
+  r->fds[0] = r->fds[1] = -1;
+  if (polled)
+    {
+      if (pipe (r->fds) < 0)
+        {
+          xcdbus_xfree (r);
+          return NULL;
+        }
+      for (i = 0; i < 2; ++i)
+        {
+          fcntl (r->fds[i], F_SETFL, fcntl (r->fds[i], F_GETFL) | O_NONBLOCK);
+          fcntl (r->fds[i], F_SETFD, FD_CLOEXEC);
+        }
+    }
+  else
+    {
+#if GLIB_CHECK_VERSION(2,32,0)
+      g_mutex_init (&r->lock);
+      g_cond_init (&r->cond);
+#else
+      r->lock = g_mutex_new ();
+      r->cond = g_cond_new ();
+#endif
+    }
+  r->cells = xcdbus_xmalloc (n * sizeof (cell_t));
+  for (i = 0; i < n; ++i)
+    {
+      r->cells[i].seq = i;
+      r->cells[i].data = NULL;
+    }
+  r->mask = n - 1;
+  return r;
+}
+
+/* items still queued are the caller's to pop first */
+INTERNAL void
+xcdbus_ring_free (xcdbus_ring_t * r)
+{
+  if (!r)
+    return;
+  if (r->fds[0] >= 0)
+    {
+      close (r->fds[0]);
+      close (r->fds[1]);
+    }
+  else
+    {
+#if GLIB_CHECK_VERSION(2,32,0)
+      g_mutex_clear (&r->lock);
+      g_cond_clear (&r->cond);
+#else
+      g_mutex_free (r->lock);
+      g_cond_free (r->cond);
+#endif
+    }
+  xcdbus_xfree (r->cells);
+  xcdbus_xfree (r);
+}
+
+static void
+ring_poke (xcdbus_ring_t * r)
+{
+  char b = 0;
+  if (write (r->fds[1], &b, 1) < 0)
+    {
+      /* pipe full, so readable: the consumer pops all there is anyway */
+    }
+}
+
+/*
+ * make the poll() on xcdbus_ring_fd return, or exactly one sleeper of
+ * xcdbus_ring_wait return NULL, now or on its next call
+ */
+INTERNAL void
+xcdbus_ring_kick (xcdbus_ring_t * r)
+{
+  if (r->fds[0] >= 0)
+    {
+      ring_poke (r);
+      return;
+    }
+  RING_LOCK (r);
+  r->wakeups++;
+  RING_SIGNAL (r);
+  RING_UNLOCK (r);
+}
+
+/* 0 if the ring is full */
+INTERNAL int
+xcdbus_ring_push (xcdbus_ring_t * r, void *p)
+{
+  guint pos = g_atomic_int_get (&r->head);
+  cell_t *cell;
+
+  for (;;)
+    {
+      gint dif;
+      cell = &r->cells[pos & r->mask];
+      dif = g_atomic_int_get (&cell->seq) - (gint) pos;
+      if (dif == 0 && g_atomic_int_compare_and_exchange (&r->head, pos, pos + 1))
+        break;
+      if (dif < 0)
+        return 0;
+      pos = g_atomic_int_get (&r->head);
+    }
+  cell->data = p;
+  g_atomic_int_set (&cell->seq, pos + 1);
+  /* after the item is in, so whoever is woken finds an item */
+  if (r->fds[0] >= 0)
+    {
+      ring_poke (r);
+      return 1;
+    }
+  RING_LOCK (r);
+  r->items++;
+  RING_SIGNAL (r);
+  RING_UNLOCK (r);
+  return 1;
+}
+
+/* NULL if the ring is empty */
+INTERNAL void *
+xcdbus_ring_pop (xcdbus_ring_t * r)
+{
+  guint pos = g_atomic_int_get (&r->tail);
+  cell_t *cell;
+  void *p;
+
+  for (;;)
+    {
+      gint dif;
+      cell = &r->cells[pos & r->mask];
+      dif = g_atomic_int_get (&cell->seq) - (gint) (pos + 1);
+      if (dif == 0 && g_atomic_int_compare_and_exchange (&r->tail, pos, pos + 1))
+        break;
+      if (dif < 0)
+        return NULL;
+      pos = g_atomic_int_get (&r->tail);
+    }
+  p = cell->data;
+  g_atomic_int_set (&cell->seq, pos + r->mask + 1);
+  return p;
+}
+
+/* polled rings: readable while items may be queued */
+INTERNAL int
+xcdbus_ring_fd (xcdbus_ring_t * r)
+{
+  return r->fds[0];
+}
+
+/* polled rings: forget wakeups before popping all there is */
+INTERNAL void
+xcdbus_ring_drain (xcdbus_ring_t * r)
+{
+  char buf[256];
+  while (read (r->fds[0], buf, sizeof (buf)) > 0)
+    ;
+}
+
+/*
+ * waited rings: pop an item, sleeping up to timeout_ms (-1 for ever) for
+ * one to come. NULL on timeout, and when woken by xcdbus_ring_kick, which
+ * takes precedence over items. Items are counted once in, so a sleeper
+ * claiming one always finds one.
+ */
+INTERNAL void *
+xcdbus_ring_wait (xcdbus_ring_t * r, int timeout_ms)
+{
+  void *p;
+#if GLIB_CHECK_VERSION(2,32,0)
+  gint64 end = g_get_monotonic_time () + (gint64) timeout_ms * 1000;
+#else
+  GTimeVal end;
+
+  g_get_current_time (&end);
+  g_time_val_add (&end, (glong) timeout_ms * 1000);
+#endif
+
+  RING_LOCK (r);
+  while (!r->items && !r->wakeups)
+    {
+#if GLIB_CHECK_VERSION(2,32,0)
+      if (timeout_ms < 0)
+        g_cond_wait (&r->cond, &r->lock);
+      else if (!g_cond_wait_until (&r->cond, &r->lock, end))
+        break;
+#else
+      if (!g_cond_timed_wait (r->cond, r->lock, timeout_ms < 0 ? NULL : &end))
+        break;
+#endif
+    }
+  if (r->wakeups)
+    {
+      r->wakeups--;
+      RING_UNLOCK (r);
+      return NULL;
+    }
+  if (!r->items)
+    {
+      RING_UNLOCK (r);
+      return NULL;
+    }
+  r->items--;
+  RING_UNLOCK (r);
+
+  /* with several producers the tail may still be being filled while the
+   * item counted sits behind it */
+  while (!(p = xcdbus_ring_pop (r)))
+    g_thread_yield ();
+  return p;
+}
@@ -0,0 +1,444 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * call counters and latency histograms per destination and method. Each
+ * thread counts into a shard of its own without locking; the lock is only
+ * taken to add an entry, and by readers merging the shards.
+ */
+
+#include "project.h"
+
+static char rcsid[] = "$Id:$";
+
+#define STATS_INTERFACE "com.citrix.xenclient.xcdbus.stats"
+
+/* bus names and members are at most 255 characters */
+#define STATS_KEY_SIZE 512
+
+typedef struct statentry {
+    /* "destination method" */
+    char *key;
+    char *destination;
+    char *method;
+    /* only destination and method are not used */
+    xcdbus_call_stats_t s;
+} statentry_t;
+
+/* counters of one thread, only ever written by it */
+typedef struct statshard {
+    /* key -> statentry_t, entries are never freed */
+    GHashTable *entries;
+} statshard_t;
+
+static int enabled = 0;
+static int count_bytes = 0;
+/* every shard made, and those of threads which exited, under the lock */
+static GList *shards = NULL;
+static GList *spare = NULL;
+/* shard of the only thread, unless thread-safe */
+static statshard_t *main_shard = NULL;
+
+G_LOCK_DEFINE_STATIC (stats);
+
+static void shard_release (gpointer data);
+
+#if GLIB_CHECK_VERSION(2,32,0)
+static GPrivate shard_key = G_PRIVATE_INIT (shard_release);
+#else
+static GPrivate *shard_key = NULL;
+#endif
+
+/* turn counting on or off, it is off until asked for */
+EXTERNAL void
+xcdbus_enable_stats (int on)
+{
+  enabled = on;
+}
+
+INTERNAL int
+xcdbus_stats_enabled (void)
+{
+  return enabled;
+}
+
+/*
+ * also count the marshalled size of blocking calls and their replies,
+ * which copies each message once more; off until asked for
+ */
+EXTERNAL void
+xcdbus_enable_stats_bytes (int on)
+{
+  count_bytes = on;
+}
+
+/* called by xcdbus_thread_init */
+INTERNAL void
+xcdbus_stats_thread_init (void)
+{
+#if !GLIB_CHECK_VERSION(2,32,0)
+  if (!shard_key)
+    shard_key = g_private_new (shard_release);
+#endif
+}
+
+/* with the lock held */
+static statshard_t *
+shard_new (void)
+{
+  statshard_t *sh;
+
+  if (spare)
+    {
+      sh = (statshard_t *) spare->data;
+      spare = g_list_delete_link (spare, spare);
+      return sh;
+    }
+  sh = g_new0 (statshard_t, 1);
+  sh->entries = g_hash_table_new (g_str_hash, g_str_equal);
+  shards = g_list_prepend (shards, sh);
+  return sh;
+}
+
+/* counts of a thread which exited stay, the next new thread continues them */
+static void
+shard_release (gpointer data)
+{
+  G_LOCK (stats);
+  spare = g_list_prepend (spare, data);
+  G_UNLOCK (stats);
+}
+
+static statshard_t *
+shard_get (void)
+{
+  statshard_t *sh;
+
+  if (!xcdbus_thread_safe ())
+    {
+      if (!main_shard)
+        main_shard = shard_new ();
+      return main_shard;
+    }
+#if GLIB_CHECK_VERSION(2,32,0)
+  sh = (statshard_t *) g_private_get (&shard_key);
+#else
+  sh = (statshard_t *) g_private_get (shard_key);
+#endif
+  if (sh)
+    return sh;
+  G_LOCK (stats);
+  sh = shard_new ();
+  G_UNLOCK (stats);
+#if GLIB_CHECK_VERSION(2,32,0)
+  g_private_set (&shard_key, sh);
+#else
+  g_private_set (shard_key, sh);
+#endif
+  return sh;
+}
+
+/* marshalled size of a message, 0 unless sizes are counted */
+INTERNAL size_t
+xcdbus_stats_message_bytes (DBusMessage * m)
+{
+  char *buf;
+  int len;
+
+  if (!enabled || !count_bytes)
+    return 0;
+  if (!m || !dbus_message_marshal (m, &buf, &len))
+    return 0;
+  dbus_free (buf);
+  return len;
+}
+
+/* entry of the calling thread for method of destination */
+static statentry_t *
+entry_get (const char *destination, const char *method)
+{
+  char key[STATS_KEY_SIZE];
+  statshard_t *sh;
+  statentry_t *e;
+
+  if (!destination)
+    destination = "";
+  if (!method)
+    method = "";
+  snprintf (key, sizeof (key), "%s %s", destination, method);
+
+  sh = shard_get ();
+  e = (statentry_t *) g_hash_table_lookup (sh->entries, key);
+  if (!e)
+    {
+      e = g_new0 (statentry_t, 1);
+      e->key = strdup (key);
+      e->destination = strdup (destination);
+      e->method = strdup (method);
+      G_LOCK (stats);
+      g_hash_table_insert (sh->entries, e->key, e);
+      G_UNLOCK (stats);
+    }
+  return e;
+}
+
+/*
+ * account one call to method of destination ("" for local work) which
+ * took us microseconds, outcome is one of XCDBUS_STATS_*
+ */
+INTERNAL void
+xcdbus_stats_record (const char *destination, const char *method, int64_t us,
+                     int outcome, size_t bytes_out, size_t bytes_in)
+{
+  statentry_t *e;
+  int b = 0;
+
+  if (!enabled)
+    return;
+  e = entry_get (destination, method);
+  e->s.calls++;
+  if (outcome == XCDBUS_STATS_ERROR)
+    e->s.errors++;
+  else if (outcome == XCDBUS_STATS_TIMEOUT)
+    e->s.timeouts++;
+  e->s.bytes_out += bytes_out;
+  e->s.bytes_in += bytes_in;
+  if (us < 0)
+    us = 0;
+  e->s.total_us += us;
+  if ((uint64_t) us > e->s.max_us)
+    e->s.max_us = us;
+  while (us > 0 && b < XCDBUS_STATS_BUCKETS - 1)
+    {
+      us >>= 1;
+      ++b;
+    }
+  e->s.histogram[b]++;
+}
+
+/* account a call caught by the stall watch, on top of xcdbus_stats_record */
+INTERNAL void
+xcdbus_stats_stall (const char *destination, const char *method)
+{
+  if (enabled)
+    entry_get (destination, method)->s.stalls++;
+}
+
+static void
+stats_add (xcdbus_call_stats_t * to, const xcdbus_call_stats_t * s)
+{
+  int i;
+
+  to->calls += s->calls;
+  to->errors += s->errors;
+  to->timeouts += s->timeouts;
+  to->stalls += s->stalls;
+  to->bytes_out += s->bytes_out;
+  to->bytes_in += s->bytes_in;
+  to->total_us += s->total_us;
+  if (s->max_us > to->max_us)
+    to->max_us = s->max_us;
+  for (i = 0; i < XCDBUS_STATS_BUCKETS; ++i)
+    to->histogram[i] += s->histogram[i];
+}
+
+static gint
+stats_cmp (gconstpointer a, gconstpointer b)
+{
+  const xcdbus_call_stats_t *x = (const xcdbus_call_stats_t *) a;
+  const xcdbus_call_stats_t *y = (const xcdbus_call_stats_t *) b;
+  int r = strcmp (x->destination, y->destination);
+  return r ? r : strcmp (x->method, y->method);
+}
+
+/*
+ * Counters of the whole process merged over its threads, sorted by
+ * destination and method. Counts of calls still being made may be caught
+ * half updated.
+ */
+EXTERNAL xcdbus_stats_t *
+xcdbus_get_stats (void)
+{
+  GHashTable *merged = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, g_free);
+  GHashTableIter it;
+  gpointer key, value;
+  GList *l, *sorted;
+  xcdbus_stats_t *r;
+  size_t head, bytes = 0;
+  char *strings;
+  int n, i = 0;
+
+  G_LOCK (stats);
+  for (l = shards; l; l = l->next)
+    {
+      g_hash_table_iter_init (&it, ((statshard_t *) l->data)->entries);
+      while (g_hash_table_iter_next (&it, &key, &value))
+        {
+          statentry_t *e = (statentry_t *) value;
+          xcdbus_call_stats_t *m = g_hash_table_lookup (merged, key);
+          if (!m)
+            {
+              m = g_new0 (xcdbus_call_stats_t, 1);
+              /* entries live for ever, so these can be used unlocked */
+              m->destination = e->destination;
+              m->method = e->method;
+              g_hash_table_insert (merged, key, m);
+              bytes += strlen (e->destination) + strlen (e->method) + 2;
+            }
+          stats_add (m, &e->s);
+        }
+    }
+  G_UNLOCK (stats);
+
+  n = g_hash_table_size (merged);
+  head = sizeof (xcdbus_stats_t) + (n ? n - 1 : 0) * sizeof (xcdbus_call_stats_t);
+  r = xcdbus_xmalloc (head + bytes);
+  r->n = n;
+  strings = (char *) r + head;
+  sorted = g_list_sort (g_hash_table_get_values (merged), stats_cmp);
+  for (l = sorted; l; l = l->next, ++i)
+    {
+      xcdbus_call_stats_t *m = (xcdbus_call_stats_t *) l->data;
+      size_t len;
+
+      r->v[i] = *m;
+      len = strlen (m->destination) + 1;
+      r->v[i].destination = memcpy (strings, m->destination, len);
+      strings += len;
+      len = strlen (m->method) + 1;
+      r->v[i].method = memcpy (strings, m->method, len);
+      strings += len;
+    }
+  g_list_free (sorted);
+  g_hash_table_destroy (merged);
+  return r;
+}
+
+/* zero the counters, calls being counted meanwhile may be partly lost */
+EXTERNAL void
+xcdbus_reset_stats (void)
+{
+  GHashTableIter it;
+  gpointer value;
+  GList *l;
+
+  G_LOCK (stats);
+  for (l = shards; l; l = l->next)
+    {
+      g_hash_table_iter_init (&it, ((statshard_t *) l->data)->entries);
+      while (g_hash_table_iter_next (&it, NULL, &value))
+        memset (&((statentry_t *) value)->s, 0, sizeof (xcdbus_call_stats_t));
+    }
+  G_UNLOCK (stats);
+}
+
+static const char stats_introspection[] =
+  DBUS_INTROSPECT_1_0_XML_DOCTYPE_DECL_NODE
+  "<node>\n"
+  "  <interface name=\"" STATS_INTERFACE "\">\n"
+  "    <!-- destination, method, calls, errors, timeouts, stalls, bytes out,\n"
+  "         bytes in, total us, max us, log2 us histogram -->\n"
+  "    <method name=\"get\">\n"
+  "      <arg name=\"stats\" type=\"a(sstttttttat)\" direction=\"out\"/>\n"
+  "    </method>\n"
+  "  </interface>\n"
+  "  <interface name=\"" DBUS_INTERFACE_INTROSPECTABLE "\">\n"
+  "    <method name=\"Introspect\">\n"
+  "      <arg name=\"data\" type=\"s\" direction=\"out\"/>\n"
+  "    </method>\n"
+  "  </interface>\n"
+  "</node>\n";
+
+static DBusMessage *
+stats_reply (DBusMessage * call)
+{
+  DBusMessageIter iter, array, st, hist;
+  DBusMessage *reply;
+  xcdbus_stats_t *s;
+  int i, ok = 1;
+
+  s = xcdbus_get_stats ();
+  if (!(reply = dbus_message_new_method_return (call)))
+    {
+      free (s);
+      return NULL;
+    }
+  dbus_message_iter_init_append (reply, &iter);
+  ok = dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY, "(sstttttttat)", &array);
+  for (i = 0; ok && i < s->n; ++i)
+    {
+      xcdbus_call_stats_t *v = &s->v[i];
+      const dbus_uint64_t *h = (const dbus_uint64_t *) v->histogram;
+
+      ok = dbus_message_iter_open_container (&array, DBUS_TYPE_STRUCT, NULL, &st) &&
+        dbus_message_iter_append_basic (&st, DBUS_TYPE_STRING, &v->destination) &&
+        dbus_message_iter_append_basic (&st, DBUS_TYPE_STRING, &v->method) &&
+        dbus_message_iter_append_basic (&st, DBUS_TYPE_UINT64, &v->calls) &&
+        dbus_message_iter_append_basic (&st, DBUS_TYPE_UINT64, &v->errors) &&
+        dbus_message_iter_append_basic (&st, DBUS_TYPE_UINT64, &v->timeouts) &&
+        dbus_message_iter_append_basic (&st, DBUS_TYPE_UINT64, &v->stalls) &&
+        dbus_message_iter_append_basic (&st, DBUS_TYPE_UINT64, &v->bytes_out) &&
+        dbus_message_iter_append_basic (&st, DBUS_TYPE_UINT64, &v->bytes_in) &&
+        dbus_message_iter_append_basic (&st, DBUS_TYPE_UINT64, &v->total_us) &&
+        dbus_message_iter_append_basic (&st, DBUS_TYPE_UINT64, &v->max_us) &&
+        dbus_message_iter_open_container (&st, DBUS_TYPE_ARRAY, "t", &hist) &&
+        dbus_message_iter_append_fixed_array (&hist, DBUS_TYPE_UINT64, &h, XCDBUS_STATS_BUCKETS) &&
+        dbus_message_iter_close_container (&st, &hist) &&
+        dbus_message_iter_close_container (&array, &st);
+    }
+  ok = ok && dbus_message_iter_close_container (&iter, &array);
+  free (s);
+  if (!ok)
+    {
+      dbus_message_unref (reply);
+      return NULL;
+    }
+  return reply;
+}
+
+/* handler of the object xcdbus_export_stats registers */
+INTERNAL DBusHandlerResult
+xcdbus_stats_object_message (DBusConnection * conn, DBusMessage * m, void *data)
+{
+  DBusMessage *reply;
+
+  if (dbus_message_is_method_call (m, STATS_INTERFACE, "get"))
+    {
+      reply = stats_reply (m);
+    }
+  else if (dbus_message_is_method_call (m, DBUS_INTERFACE_INTROSPECTABLE, "Introspect"))
+    {
+      const char *xml = stats_introspection;
+      reply = dbus_message_new_method_return (m);
+      if (reply && !dbus_message_append_args (reply, DBUS_TYPE_STRING, &xml, DBUS_TYPE_INVALID))
+        {
+          dbus_message_unref (reply);
+          reply = NULL;
+        }
+    }
+  else
+    {
+      return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+    }
+
+  if (!reply)
+    return DBUS_HANDLER_RESULT_NEED_MEMORY;
+  dbus_connection_send (conn, reply, NULL);
+  dbus_message_unref (reply);
+  return DBUS_HANDLER_RESULT_HANDLED;
+}
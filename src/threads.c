@@ -0,0 +1,177 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * thread-safe mode: registrations serialize on one lock, lookups read
+ * published snapshots without locking. A replaced snapshot is retired and
+ * only freed once no reader is left that could still be looking at it.
+ * Readers are counted per epoch; retiring flips the epoch once the readers
+ * of the one before are gone, so only readers that started before a flip
+ * can hold frees back, and new readers never do.
+ */
+
+#include "project.h"
+
+static char rcsid[] = "$Id:$";
+
+typedef struct retired {
+    void (*fn) (void *);
+    void *p;
+} retired_t;
+
+static int thread_safe = 0;
+/* lookups in progress, by the epoch they started in */
+static volatile gint epoch = 0;
+static volatile gint readers[2] = { 0, 0 };
+/* retired_t, under the lock: since the last flip, and from the epoch
+ * before, waiting for its readers to go */
+static GList *retired = NULL;
+static GList *retired_aged = NULL;
+
+G_LOCK_DEFINE_STATIC (registry);
+/* watch and timer tables of all connections, see xcdbus_init_threaded */
+G_LOCK_DEFINE_STATIC (loop);
+
+/*
+ * Make connection lookups, the proxy cache and name owner tracking safe to
+ * use from several threads, and set libdbus and dbus-glib up for threads.
+ * Must be called before the first connection is made. Enabling opt-in
+ * caches, trackers and property mirrors stays with the dispatching thread;
+ * reads through them are then safe from any thread.
+ */
+EXTERNAL void
+xcdbus_thread_init (void)
+{
+  if (thread_safe)
+    return;
+#if !GLIB_CHECK_VERSION(2,32,0)
+  if (!g_thread_supported ())
+    g_thread_init (NULL);
+#endif
+  dbus_threads_init_default ();
+  dbus_g_thread_init ();
+  xcdbus_stats_thread_init ();
+  thread_safe = 1;
+}
+
+INTERNAL int
+xcdbus_thread_safe (void)
+{
+  return thread_safe;
+}
+
+/* serializes every change to registries, no-op unless thread-safe */
+INTERNAL void
+xcdbus_registry_lock (void)
+{
+  if (thread_safe)
+    G_LOCK (registry);
+}
+
+INTERNAL void
+xcdbus_registry_unlock (void)
+{
+  if (thread_safe)
+    G_UNLOCK (registry);
+}
+
+/* serializes main loop bookkeeping, no-op unless thread-safe. Nothing
+ * taking the libdbus connection lock may be called while holding it. */
+INTERNAL void
+xcdbus_loop_lock (void)
+{
+  if (thread_safe)
+    G_LOCK (loop);
+}
+
+INTERNAL void
+xcdbus_loop_unlock (void)
+{
+  if (thread_safe)
+    G_UNLOCK (loop);
+}
+
+/* bracket reading a published snapshot, pass what it returns to _end */
+INTERNAL int
+xcdbus_read_begin (void)
+{
+  int e;
+
+  if (!thread_safe)
+    return 0;
+  for (;;)
+    {
+      e = g_atomic_int_get (&epoch);
+      g_atomic_int_inc (&readers[e]);
+      /* counted in the epoch we saw, not one flipped away meanwhile */
+      if (g_atomic_int_get (&epoch) == e)
+        return e;
+      g_atomic_int_add (&readers[e], -1);
+    }
+}
+
+INTERNAL void
+xcdbus_read_end (int e)
+{
+  if (thread_safe)
+    g_atomic_int_add (&readers[e], -1);
+}
+
+static void
+retired_free (GList * l)
+{
+  while (l)
+    {
+      retired_t *r = (retired_t *) l->data;
+      l = g_list_delete_link (l, l);
+      r->fn (r->p);
+      g_free (r);
+    }
+}
+
+/*
+ * Free p with fn once readers cannot reach it anymore: right away unless
+ * thread-safe. Call with the lock held, after publishing what replaces p;
+ * a reader starting after that can only find the replacement.
+ */
+INTERNAL void
+xcdbus_retire (void (*fn) (void *), void *p)
+{
+  retired_t *r;
+  int e;
+
+  if (!thread_safe)
+    {
+      fn (p);
+      return;
+    }
+  r = g_new (retired_t, 1);
+  r->fn = fn;
+  r->p = p;
+  retired = g_list_prepend (retired, r);
+
+  /* readers of the epoch before may still see the aged ones, and the
+   * recent ones too unless they started in this epoch */
+  e = g_atomic_int_get (&epoch);
+  if (g_atomic_int_get (&readers[!e]))
+    return;
+  retired_free (retired_aged);
+  retired_aged = retired;
+  retired = NULL;
+  g_atomic_int_set (&epoch, !e);
+}
@@ -0,0 +1,131 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ * 
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/* binary min-heap of libdbus timeouts ordered by deadline */
+
+#include "project.h"
+
+static char rcsid[] = "$Id:$";
+
+/* monotonic clock in milliseconds */
+INTERNAL int64_t
+xcdbus_now_ms (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* monotonic clock in microseconds */
+INTERNAL int64_t
+xcdbus_now_us (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void
+heap_set (xcdbus_timerheap_t * h, int i, xcdbus_timeout_t * t)
+{
+  h->v[i] = t;
+  t->index = i;
+}
+
+static void
+heap_up (xcdbus_timerheap_t * h, int i)
+{
+  xcdbus_timeout_t *t = h->v[i];
+  while (i > 0)
+    {
+      int parent = (i - 1) / 2;
+      if (h->v[parent]->deadline <= t->deadline)
+        break;
+      heap_set (h, i, h->v[parent]);
+      i = parent;
+    }
+  heap_set (h, i, t);
+}
+
+static void
+heap_down (xcdbus_timerheap_t * h, int i)
+{
+  xcdbus_timeout_t *t = h->v[i];
+  for (;;)
+    {
+      int child = 2 * i + 1;
+      if (child >= h->n)
+        break;
+      if (child + 1 < h->n && h->v[child + 1]->deadline < h->v[child]->deadline)
+        child++;
+      if (t->deadline <= h->v[child]->deadline)
+        break;
+      heap_set (h, i, h->v[child]);
+      i = child;
+    }
+  heap_set (h, i, t);
+}
+
+INTERNAL void
+xcdbus_timerheap_insert (xcdbus_timerheap_t * h, xcdbus_timeout_t * t)
+{
+  if (t->index >= 0)
+    xcdbus_timerheap_remove (h, t);
+
+  if (h->n == h->size)
+    {
+      h->size = h->size ? h->size * 2 : 8;
+      h->v = (xcdbus_timeout_t **) xcdbus_xrealloc (h->v,
+                                    sizeof (xcdbus_timeout_t *) * h->size);
+    }
+  h->v[h->n] = t;
+  t->index = h->n++;
+  heap_up (h, t->index);
+}
+
+INTERNAL void
+xcdbus_timerheap_remove (xcdbus_timerheap_t * h, xcdbus_timeout_t * t)
+{
+  int i = t->index;
+  if (i < 0)
+    return;
+
+  t->index = -1;
+  if (i == --h->n)
+    return;
+
+  heap_set (h, i, h->v[h->n]);
+  if (i > 0 && h->v[i]->deadline < h->v[(i - 1) / 2]->deadline)
+    heap_up (h, i);
+  else
+    heap_down (h, i);
+}
+
+INTERNAL xcdbus_timeout_t *
+xcdbus_timerheap_top (xcdbus_timerheap_t * h)
+{
+  return h->n ? h->v[0] : NULL;
+}
+
+INTERNAL void
+xcdbus_timerheap_free (xcdbus_timerheap_t * h)
+{
+  xcdbus_xfree (h->v);
+  h->v = NULL;
+  h->n = h->size = 0;
+}
@@ -17,6 +17,7 @@
  */
 
 #include "project.h"
+#include <errno.h>
 #include "rpcgen/db_client.h"
 #include "rpcgen/xenmgr_client.h"
 
@@ -27,45 +28,244 @@ static const char *DB_INTERFACE = "com.citrix.xenclient.db";
 
 static const char *XENMGR_SERVICE = "com.citrix.xenclient.xenmgr";
 static const char *XENMGR_OBJ = "/";
+static const char *XENMGR_INTERFACE = "com.citrix.xenclient.xenmgr";
+/* emitted by xenmgr for every vm lifecycle transition */
+#define XENMGR_VM_STATE_SIGNAL "vm_state_changed"
+#define VM_STATE_MATCH_RULE "type='signal',sender='com.citrix.xenclient.xenmgr'," \
+    "interface='com.citrix.xenclient.xenmgr',member='" XENMGR_VM_STATE_SIGNAL "'"
 
 static const char *INPUT_SERVICE = "com.citrix.xenclient.input";
 static const char *INPUT_OBJ = "/";
 static const char *INPUT_INTERFACE = "com.citrix.xenclient.input";
+/* emitted by the input daemon with the new domid whenever focus moves */
+#define INPUT_FOCUS_SIGNAL "focus_change"
+#define FOCUS_MATCH_RULE "type='signal',sender='com.citrix.xenclient.input'," \
+    "interface='com.citrix.xenclient.input',member='" INPUT_FOCUS_SIGNAL "'"
 
 #define BLOCKING_TIMEOUT 5000
 
+/* how watches are integrated into the caller's main loop */
+#define BACKEND_SELECT 0
+#define BACKEND_EVENT  1
+#define BACKEND_EPOLL  2
+#define BACKEND_GLIB   3
+#define BACKEND_THREAD 4
+
+/* any unique name leaving the bus, for the sender domid cache */
+#define DOMID_MATCH_RULE "type='signal',sender='org.freedesktop.DBus'," \
+    "interface='org.freedesktop.DBus',member='NameOwnerChanged',arg2=''"
+
+/* how often xcdbus_wait_service asks the bus when it cannot dispatch, ms */
+#define WAIT_SERVICE_POLL 250
+
+/* max ready events handled by one xcdbus_process_epoll */
+#define EPOLL_BATCH 16
+
+/* call chain depth recorded for a stall */
+#define STALL_FRAMES 32
+
+/* threaded connections: slots of the queues to and from worker threads */
+#define THREAD_QUEUE_SIZE 1024
+/* how long the I/O thread sleeps while the worker queue is full, ms */
+#define THREAD_BACKLOG_POLL 10
+/* how long a worker backs off while the send queue is full, ms */
+#define THREAD_SEND_BACKOFF 1
+
+/* characters which cannot appear in bus names, object paths or interfaces */
+#define PROXY_KEY_SEP ' '
+
+/* owner of a watched bus name, as last reported by the bus */
+#define OWNER_UNKNOWN 0
+#define OWNER_NONE    1
+#define OWNER_SET     2
+
+typedef struct nameowner {
+    int state;
+    /* unique name of the owner when OWNER_SET */
+    char *owner;
+} nameowner_t;
+
+/* domid of a unique bus name, pending is set while it is being resolved */
+typedef struct senderdomid {
+    int32_t domid;
+    /* a prefetch is on its way, and our reference to it once known */
+    int querying;
+    DBusPendingCall *pending;
+} senderdomid_t;
+
+/* caller of a dispatched message, see xcdbus_get_msg_ctx */
+struct xcdbus_msg_ctx {
+    volatile gint refs;
+    /* NULL once the connection is shut down; with link, under the lock */
+    struct xcdbus_conn *c;
+    /* link in the connection's list of live contexts */
+    GList *link;
+    char *sender;
+    dbus_uint32_t serial;
+    /* -2 until resolved */
+    int32_t domid;
+};
+
+/* properties of one object interface, kept current from PropertiesChanged */
+typedef struct propmirror {
+    struct xcdbus_conn *c;
+    /* "service objpath interface", also the hash key */
+    char *key;
+    char *service;
+    char *objpath;
+    char *interface;
+    char *rule;
+    /* NULL until fetched, and again once stale */
+    xcdbus_props_t *props;
+    /* GetAll failed, reads ask for single properties until owner change */
+    int getall_failed;
+    xcdbus_prop_changed_cb cb;
+    void *priv;
+} propmirror_t;
+
 typedef struct proxyentry {
+    struct xcdbus_conn *c;
     DBusGProxy *proxy;
-    DBusGConnection *conn;
-    const char *service;
-    const char *objpath;
-    const char *interface;
+    /* "service objpath interface", owned, also the hash key */
+    char *key;
 } proxyentry_t;
 
+/* one private bus connection of a pool */
+typedef struct poolconn {
+    DBusConnection *conn;
+    /* blocking calls waiting for a reply on it */
+    volatile gint inflight;
+} poolconn_t;
+
+/* private connections blocking calls are spread across, see
+ * xcdbus_set_connection_pool */
+typedef struct connpool {
+    volatile gint refs;
+    /* where the next search for the least busy connection starts */
+    volatile gint next;
+    int n;
+    poolconn_t v[1];
+} connpool_t;
+
 struct xcdbus_conn {
     DBusGConnection *connG;
     DBusConnection  *conn;
-    xcdbus_watch_t  *watches;
+    xcdbus_watch_t  **watches;
     int nwatches;
     int dispatching;
     int gloop;
-    char sender[16];
+    int backend;
+    /* epoll backend: epoll set, and eventfd raised when messages are queued */
+    int epfd;
+    int evfd;
+    /* armed libdbus timeouts, earliest first */
+    xcdbus_timerheap_t timers;
+    /* epoll backend: timerfd armed at the earliest deadline */
+    int tfd;
+#ifdef HAVE_LIBEVENT
+    /* libevent backend: timer armed at the earliest deadline */
+    struct event tev;
+    int tev_added;
+    /* libevent backend: runs dispatch again when a budget left work */
+    struct event dev;
+#endif
+    /* message being handled, from xcdbus_filter until its dispatch returns,
+     * and its context once asked for */
+    DBusMessage *current;
+    xcdbus_msg_ctx_t *current_ctx;
+    /* glib backend: idle clearing current after dbus-glib dispatched it */
+    GSource *current_clear;
+    /* contexts handed out and not released yet, under the lock: they are
+     * released on whichever thread the application kept them */
+    GList *msg_ctxs;
+    /* proxy cache: key -> proxyentry_t. Callers borrow the proxies, so
+     * entries are only removed at shutdown */
+    GHashTable *proxies;
+    /* thread-safe mode: copy of proxies for lock-free lookups, and entries
+     * removed since it was last published */
+    GHashTable *proxy_snap;
+    GList *proxy_dead;
+    /* names we receive NameOwnerChanged for -> nameowner_t */
+    GHashTable *owners;
+    /* our DBusPendingCall*s which did not complete yet */
+    GHashTable *pending;
+    /* asynchronous db requests awaiting a reply */
+    int db_inflight;
+    /* opt-in cache in front of xcdbus_read_db */
+    xcdbus_dbcache_t *dbcache;
+    /* bumped whenever cached db values may have changed; a read reply only
+     * fills the cache if nothing was invalidated since the read was sent */
+    unsigned long db_generation;
+    /* glib backend: context our timers are attached to, NULL for default */
+    GMainContext *gctx;
+    /* xcdbus_wait_service_async requests, servicewait_t */
+    GList *service_waits;
+    /* "service objpath interface" -> propmirror_t */
+    GHashTable *mirrors;
+    /* focus tracker: domid kept current from the input daemon's signal */
+    int focus_tracking;
+    int focus_known;
+    int32_t focus_domid;
+    xcdbus_focus_cb focus_cb;
+    void *focus_priv;
+    /* domain tracker: running domids as keys, from xenmgr */
+    int vm_tracking;
+    /* published, read any thread within xcdbus_read_begin/end */
+    volatile gint vm_known;
+    GHashTable *vm_domids;
+    /* a list_domids refresh is in flight, and another is wanted after it */
+    int vm_refresh;
+    int vm_refresh_again;
+    xcdbus_domain_cb vm_cb;
+    void *vm_priv;
+    /* unique bus name -> senderdomid_t */
+    GHashTable *domids;
+    /* listening to unique names going away, for the domid cache */
+    int domids_match;
+    /* resolve domids of method callers as soon as dispatch sees them */
+    int domids_prefetch;
+    /* hold signals back and send them together once per loop iteration */
+    int signal_batching;
+    /* batched DBusMessage*s not sent yet, and the timer sending them */
+    GQueue batched;
+    xcdbus_timeout_t *batch_timer;
+    /* limits of each xcdbus_dispatch, 0 for none */
+    unsigned int budget_messages;
+    unsigned int budget_us;
+    xcdbus_dispatch_stats_t dstats;
+    /* threaded connections: the I/O thread, messages for workers, messages
+     * to send, and what did not fit into inq yet (I/O thread only) */
+    GThread *io_thread;
+    volatile gint io_stop;
+    xcdbus_ring_t *inq;
+    xcdbus_ring_t *outq;
+    GQueue in_backlog;
+    /* blocking calls go out on these when set, published for lock-free use */
+    connpool_t *pool;
+    /* where xcdbus_export_stats put its object */
+    char *stats_path;
+    /* thread running xcdbus_dispatch, in thread-safe mode */
+    GThread *dispatch_thread;
+    /* stall watch: blocking calls from dispatch or longer than stall_ms */
+    int stall_watch;
+    unsigned int stall_ms;
+    xcdbus_stall_cb stall_cb;
+    void *stall_priv;
 };
 
-static proxyentry_t *proxy_entries = NULL;
-static int num_proxy_entries = 0;
-
-static xcdbus_conn_t **connections = NULL;
-static int num_connections = 0;
+/* xcdbus_conn_t*, DBusConnection* and DBusGConnection* -> xcdbus_conn_t*,
+ * never changed once published, see threads.c */
+static GHashTable *connections = NULL;
 
 static xcdbus_watch_t *
 find_watch_by_fd (xcdbus_conn_t * c, int fd, int create)
 {
   int i;
+  xcdbus_watch_t *w;
   for (i = 0; i < c->nwatches; ++i)
     {
-      if (c->watches[i].fd == fd)
-        return &c->watches[i];
+      if (c->watches[i]->fd == fd)
+        return c->watches[i];
     }
 
   if (!create)
@@ -73,359 +273,2397 @@ find_watch_by_fd (xcdbus_conn_t * c, int fd, int create)
 
   c->nwatches++;
 
+  /* entries are allocated separately so that their address stays valid
+   * for the event backends as the table grows */
   c->watches =
-    (xcdbus_watch_t *) xcdbus_xrealloc (c->watches,
-                                       sizeof (xcdbus_watch_t) * c->nwatches);
+    (xcdbus_watch_t **) xcdbus_xrealloc (c->watches,
+                                        sizeof (xcdbus_watch_t *) * c->nwatches);
 
-  memset (&c->watches[i], 0, sizeof (xcdbus_watch_t));
-  c->watches[i].fd = fd;
-  c->watches[i].c = c;
+  w = xcdbus_xmalloc (sizeof (xcdbus_watch_t));
+  memset (w, 0, sizeof (xcdbus_watch_t));
+  w->fd = fd;
+  w->c = c;
+  c->watches[i] = w;
 
-  return &c->watches[i];
+  return w;
 }
 
-static dbus_bool_t
-watch_add (DBusWatch * watch, void *_c)
+#ifdef HAVE_LIBEVENT
+static void watch_sync_event (xcdbus_watch_t * w);
+#endif
+#ifdef HAVE_SYS_EPOLL_H
+static void watch_sync_epoll (xcdbus_conn_t * c, xcdbus_watch_t * w);
+#endif
+static void io_thread_wakeup (xcdbus_conn_t * c);
+
+/* propagate watch conditions to the event backend in use */
+static void
+watch_sync (xcdbus_conn_t * c, xcdbus_watch_t * w)
+{
+  switch (c->backend)
+    {
+#ifdef HAVE_LIBEVENT
+    case BACKEND_EVENT:
+      watch_sync_event (w);
+      break;
+#endif
+#ifdef HAVE_SYS_EPOLL_H
+    case BACKEND_EPOLL:
+      watch_sync_epoll (c, w);
+      break;
+#endif
+    case BACKEND_THREAD:
+      io_thread_wakeup (c);
+      break;
+    default:
+      /* select and poll users pick the conditions up on next iteration */
+      break;
+    }
+}
+
+/* libdbus uses distinct watches for reading and writing the same fd */
+static void
+watch_update (xcdbus_conn_t * c, DBusWatch * watch, int enabled)
 {
-  xcdbus_conn_t *c = (xcdbus_conn_t *) _c;
   int fd = dbus_watch_get_unix_fd (watch);
+  int flags = dbus_watch_get_flags (watch);
+  xcdbus_watch_t *w;
 
-  if (dbus_watch_get_enabled (watch))
+  /* libdbus calls in here from whichever thread does I/O */
+  xcdbus_loop_lock ();
+  w = find_watch_by_fd (c, fd, enabled);
+  if (!w)
     {
-      xcdbus_watch_t *w = find_watch_by_fd (c, fd, 1);
-      int flags = dbus_watch_get_flags (watch);
-      if (flags & DBUS_WATCH_READABLE)
-          w->cond |= XCDBUS_FD_COND_READ;
-      if (flags & DBUS_WATCH_WRITABLE)
-          w->cond |= XCDBUS_FD_COND_WRITE;
+      xcdbus_loop_unlock ();
+      return;
+    }
 
-      /* integrate watch with select loop */
-      if (w->cond) {
-          w->dbw = watch;
-      }
+  if (flags & DBUS_WATCH_READABLE)
+    {
+      if (enabled)
+        w->rdw = watch;
+      else if (w->rdw == watch)
+        w->rdw = NULL;
+    }
+  if (flags & DBUS_WATCH_WRITABLE)
+    {
+      if (enabled)
+        w->wrw = watch;
+      else if (w->wrw == watch)
+        w->wrw = NULL;
     }
 
+  w->cond = (w->rdw ? XCDBUS_FD_COND_READ : 0) |
+            (w->wrw ? XCDBUS_FD_COND_WRITE : 0);
+  watch_sync (c, w);
+  xcdbus_loop_unlock ();
+}
+
+static dbus_bool_t
+watch_add (DBusWatch * watch, void *_c)
+{
+  if (dbus_watch_get_enabled (watch))
+    watch_update ((xcdbus_conn_t *) _c, watch, 1);
   return TRUE;
 }
 
 static void
 watch_remove (DBusWatch * watch, void *_c)
 {
-  xcdbus_conn_t *c = (xcdbus_conn_t *) _c;
-  int fd = dbus_watch_get_unix_fd (watch);
-  int cond = 0;
-  xcdbus_watch_t *w = find_watch_by_fd (c, fd, 0);
-  if (!w) return;
-
-  int flags = dbus_watch_get_flags(watch);
-  if (flags & DBUS_WATCH_READABLE) cond |= XCDBUS_FD_COND_READ;
-  if (flags & DBUS_WATCH_WRITABLE) cond |= XCDBUS_FD_COND_WRITE;
-  /* deintegrate from select loop */
-  w->cond &= ~cond;
-  if (!w->cond) {
-      w->dbw = NULL;
-  }
+  watch_update ((xcdbus_conn_t *) _c, watch, 0);
 }
 
 static void
-watch_toggle (DBusWatch * watch, void *data)
+watch_toggle (DBusWatch * watch, void *_c)
 {
-    if (dbus_watch_get_enabled (watch)) {
-        watch_add (watch, data);
-    }
-    else {
-        watch_remove (watch, data);
-    }
+  watch_update ((xcdbus_conn_t *) _c, watch, dbus_watch_get_enabled (watch));
 }
 
 static void
-watch_process (xcdbus_conn_t * c, DBusWatch * watch, int flags_to_process)
+watch_process (xcdbus_conn_t * c, xcdbus_watch_t * w, int flags_to_process)
 {
-  if (!watch)
-    return;                     /* why ? */
+  int errflags = flags_to_process & (DBUS_WATCH_ERROR | DBUS_WATCH_HANGUP);
+  DBusWatch *rdw, *wrw;
+  int timed = xcdbus_stats_enabled ();
+  int64_t start = timed ? xcdbus_now_us () : 0;
 
-  dbus_watch_handle (watch, flags_to_process);
+  /* the ref keeps the transport and so its watches allocated, but libdbus
+   * may drop either from the table on any thread: read it locked */
   dbus_connection_ref (c->conn);
+  xcdbus_loop_lock ();
+  rdw = w->rdw;
+  wrw = w->wrw;
+  xcdbus_loop_unlock ();
+
+  /* error conditions go to whichever watch is there to take them */
+  if (rdw && (flags_to_process & (DBUS_WATCH_READABLE | errflags)))
+    {
+      dbus_watch_handle (rdw, flags_to_process & ~DBUS_WATCH_WRITABLE);
+      errflags = 0;
+    }
+  /* handling the read side may have dropped the write watch */
+  xcdbus_loop_lock ();
+  if (wrw != w->wrw)
+    wrw = NULL;
+  xcdbus_loop_unlock ();
+  if (wrw && ((flags_to_process & DBUS_WATCH_WRITABLE) || errflags))
+    {
+      dbus_watch_handle (wrw, (flags_to_process & DBUS_WATCH_WRITABLE) | errflags);
+    }
 
   xcdbus_dispatch(c);
 
   dbus_connection_unref (c->conn);
+  if (timed)
+    xcdbus_stats_record ("", "watch", xcdbus_now_us () - start, XCDBUS_STATS_OK, 0, 0);
 }
 
-/* xcdbus_conn_t* of either DBusConnection*, DBusGConnection* or xcdbus_conn_t* */
-EXTERNAL
-xcdbus_conn_t *xcdbus_of_conn(void *c)
+#ifdef HAVE_LIBEVENT
+static void timers_sync_event (xcdbus_conn_t * c);
+#endif
+#ifdef HAVE_SYS_EPOLL_H
+static void timers_sync_epoll (xcdbus_conn_t * c);
+#endif
+
+/* propagate the earliest deadline to the event backend in use */
+static void
+timers_sync (xcdbus_conn_t * c)
 {
-    int i;
-    for ( i = 0; i < num_connections; ++i ) {
-        xcdbus_conn_t *xc = connections[i];
-        if (xc == c || xc->conn == c || xc->connG == c) {
-            return xc;
-        }
+  switch (c->backend)
+    {
+#ifdef HAVE_LIBEVENT
+    case BACKEND_EVENT:
+      timers_sync_event (c);
+      break;
+#endif
+#ifdef HAVE_SYS_EPOLL_H
+    case BACKEND_EPOLL:
+      timers_sync_epoll (c);
+      break;
+#endif
+    case BACKEND_THREAD:
+      io_thread_wakeup (c);
+      break;
+    default:
+      /* select and poll users ask xcdbus_next_timeout */
+      break;
     }
-    return NULL;
 }
 
-static xcdbus_conn_t *xcdbus_init_common(const char *service_name, DBusGConnection *connG, int gloop)
+/* libdbus is done with the timeout, maybe while timers_process handles it */
+static void
+timer_free (void *data)
 {
-  DBusError error;
-  xcdbus_conn_t *c = NULL;
-  int ret = 0;
+  xcdbus_timeout_t *t = (xcdbus_timeout_t *) data;
 
-  DBusConnection *conn = (DBusConnection*) dbus_g_connection_get_connection(connG);
+  xcdbus_loop_lock ();
+  t->dead = t->firing;
+  xcdbus_loop_unlock ();
+  if (!t->dead)
+    xcdbus_xfree (t);
+}
 
-  if (service_name) {
-      dbus_error_init (&error);
-      ret =
-          dbus_bus_request_name (conn, service_name, DBUS_NAME_FLAG_DO_NOT_QUEUE,
-                                 &error);
-      if (ret == -1) {
-          dbus_error_free (&error);
-          return NULL;
-      }
-      dbus_error_free (&error);
-  }
+static void
+timer_update (xcdbus_conn_t * c, DBusTimeout * timeout, int enabled)
+{
+  xcdbus_timeout_t *t;
 
-  c = xcdbus_xmalloc (sizeof (xcdbus_conn_t));
-  memset (c, 0, sizeof (*c));
+  xcdbus_loop_lock ();
+  t = (xcdbus_timeout_t *) dbus_timeout_get_data (timeout);
+  if (!t)
+    {
+      if (!enabled)
+        {
+          xcdbus_loop_unlock ();
+          return;
+        }
+      t = xcdbus_xmalloc (sizeof (xcdbus_timeout_t));
+      t->t = timeout;
+      t->index = -1;
+      t->firing = t->dead = 0;
+      dbus_timeout_set_data (timeout, t, timer_free);
+    }
 
-  c->connG = connG;
-  c->conn = conn;
-  c->watches = xcdbus_xmalloc (1);
-  c->nwatches = 0;
-  c->dispatching = 0;
-  c->gloop = gloop;
+  if (enabled)
+    {
+      t->deadline = xcdbus_now_ms () + dbus_timeout_get_interval (timeout);
+      xcdbus_timerheap_insert (&c->timers, t);
+    }
+  else
+    {
+      xcdbus_timerheap_remove (&c->timers, t);
+    }
+  timers_sync (c);
+  xcdbus_loop_unlock ();
+}
 
-  ++num_connections;
-  connections = realloc( connections, num_connections * sizeof(xcdbus_conn_t) );
-  connections[num_connections-1] = c;
-  return c;
+static dbus_bool_t
+timer_add (DBusTimeout * timeout, void *_c)
+{
+  timer_update ((xcdbus_conn_t *) _c, timeout, dbus_timeout_get_enabled (timeout));
+  return TRUE;
 }
 
-EXTERNAL xcdbus_conn_t *
-xcdbus_init(const char *service_name)
+static void
+timer_remove (DBusTimeout * timeout, void *_c)
 {
-  DBusGConnection *conn = NULL;
+  timer_update ((xcdbus_conn_t *) _c, timeout, 0);
+}
 
-  conn = dbus_g_bus_get(DBUS_BUS_SYSTEM, NULL);
-  if (!conn) {
-      return NULL;
-  }
-  return xcdbus_init2(service_name, conn);
+static void
+timer_toggle (DBusTimeout * timeout, void *_c)
+{
+  timer_update ((xcdbus_conn_t *) _c, timeout, dbus_timeout_get_enabled (timeout));
 }
 
-EXTERNAL xcdbus_conn_t * 
-xcdbus_init2(const char *service_name, DBusGConnection *connG)
+/* handle expired libdbus timeouts, e.g. pending calls without a reply */
+static void
+timers_process (xcdbus_conn_t * c)
 {
-  xcdbus_conn_t *c = xcdbus_init_common(service_name, connG, 0);
+  int64_t now = xcdbus_now_ms ();
+  xcdbus_timeout_t *t;
+  int fired = 0;
 
-  /* setup watching */
-  dbus_connection_set_watch_functions (
-      c->conn,
-      watch_add,
-      watch_remove, watch_toggle, c, NULL
-  );
+  dbus_connection_ref (c->conn);
 
-  return c;
+  /* handlers run unlocked, they may add or remove timers */
+  xcdbus_loop_lock ();
+  while ((t = xcdbus_timerheap_top (&c->timers)) && t->deadline <= now)
+    {
+      DBusTimeout *timeout = t->t;
+      int interval;
+
+      if (!timeout)
+        {
+          /* one of ours, see timer_start */
+          void (*fn) (void *) = t->fn;
+          void *data = t->data;
+          xcdbus_timerheap_remove (&c->timers, t);
+          g_free (t);
+          xcdbus_loop_unlock ();
+          fn (data);
+          xcdbus_loop_lock ();
+          continue;
+        }
+
+      interval = dbus_timeout_get_interval (timeout);
+      /* libdbus timeouts repeat until removed; rearm first since handling
+       * may remove it, here or on another thread, which t outlives */
+      t->deadline = now + (interval > 0 ? interval : 1);
+      xcdbus_timerheap_insert (&c->timers, t);
+      t->firing = 1;
+      xcdbus_loop_unlock ();
+      dbus_timeout_handle (timeout);
+      xcdbus_loop_lock ();
+      t->firing = 0;
+      if (t->dead)
+        xcdbus_xfree (t);
+      fired = 1;
+    }
+
+  /* also rearms a backend timer which went off early */
+  timers_sync (c);
+  xcdbus_loop_unlock ();
+  if (fired)
+    xcdbus_dispatch (c);
+
+  dbus_connection_unref (c->conn);
 }
 
-/* any of the arguments can be NULL */
-EXTERNAL xcdbus_conn_t *
-xcdbus_init_with_gloop(const char *service_name, DBusGConnection *conn, GMainLoop *loop)
+static gboolean
+timer_glib_cb (gpointer data)
 {
-    int gloop=0;
-    if (!conn) {
-        conn = dbus_g_bus_get(DBUS_BUS_SYSTEM, NULL);
-    }
-    if (!conn) {
-        return NULL;
-    }
-    if (loop) {
-        gloop=1;
-        dbus_connection_setup_with_g_main(dbus_g_connection_get_connection(conn), g_main_loop_get_context(loop));
-    }
-    /* DO NOT SETUP WATCH functions here, we assume glib's main loop takes care of that */
-    return xcdbus_init_common(service_name, conn, gloop);
+  xcdbus_timeout_t *t = (xcdbus_timeout_t *) data;
+  void (*fn) (void *) = t->fn;
+  void *fn_data = t->data;
+
+  g_source_unref (t->source);
+  g_free (t);
+  fn (fn_data);
+  return FALSE;
 }
 
-#ifdef HAVE_LIBEVENT
-static void
-watch_process (xcdbus_conn_t * c, DBusWatch * watch, int flags_to_process);
+/*
+ * one-shot timer running fn(data) after ms on whatever drives the
+ * connection. The handle is freed once fn runs, fn must not cancel it.
+ */
+static xcdbus_timeout_t *
+timer_start (xcdbus_conn_t * c, int ms, void (*fn) (void *), void *data)
+{
+  xcdbus_timeout_t *t = g_new0 (xcdbus_timeout_t, 1);
+  t->index = -1;
+  t->fn = fn;
+  t->data = data;
+
+  if (c->backend == BACKEND_GLIB)
+    {
+      t->source = g_timeout_source_new (ms);
+      g_source_set_callback (t->source, timer_glib_cb, t, NULL);
+      g_source_attach (t->source, c->gctx);
+      return t;
+    }
+
+  t->deadline = xcdbus_now_ms () + ms;
+  xcdbus_loop_lock ();
+  xcdbus_timerheap_insert (&c->timers, t);
+  timers_sync (c);
+  xcdbus_loop_unlock ();
+  return t;
+}
 
 static void
-event_cb(int fd, short ev_type, void *priv)
+timer_cancel (xcdbus_conn_t * c, xcdbus_timeout_t * t)
 {
-  xcdbus_watch_t *w = (xcdbus_watch_t *)priv;
-  int watch_flags = 0;
-
-  if (ev_type & EV_READ)
+  if (!t)
+    return;
+  if (t->source)
     {
-      watch_flags |= DBUS_WATCH_READABLE;
+      g_source_destroy (t->source);
+      g_source_unref (t->source);
     }
-  if (ev_type & EV_WRITE)
+  else
     {
-      watch_flags |= DBUS_WATCH_WRITABLE;
+      xcdbus_loop_lock ();
+      xcdbus_timerheap_remove (&c->timers, t);
+      timers_sync (c);
+      xcdbus_loop_unlock ();
     }
-
-  if (watch_flags) {
-      watch_process (w->c, w->dbw, watch_flags);
-  }
+  g_free (t);
 }
 
-static dbus_bool_t
-watch_add_event (DBusWatch * watch, void *_c)
+/* install our watch and timeout callbacks, for the non glib backends */
+static void
+setup_main_loop (xcdbus_conn_t * c, int backend)
 {
-  xcdbus_conn_t *c = (xcdbus_conn_t *) _c;
-  int fd = dbus_watch_get_unix_fd (watch);
+  c->backend = backend;
+  dbus_connection_set_watch_functions (
+      c->conn,
+      watch_add,
+      watch_remove,
+      watch_toggle,
+      c, NULL);
+  dbus_connection_set_timeout_functions (
+      c->conn,
+      timer_add,
+      timer_remove,
+      timer_toggle,
+      c, NULL);
+}
 
-  if (dbus_watch_get_enabled (watch))
-    {
-      xcdbus_watch_t *w = find_watch_by_fd (c, fd, 1);
-      int flags = dbus_watch_get_flags (watch);
-      short ev_type = EV_PERSIST;
+/*
+ * send a method call without blocking; notify runs from dispatch, or in
+ * thread-safe mode from here if the reply was dispatched meanwhile, and must
+ * end with pending_done. data_free is called once the call is finished or
+ * cancelled by xcdbus_shutdown, and also when sending fails. Returns 0 if
+ * it could not be sent. ref (can be NULL) gets a reference to the pending
+ * call taken before notify can run.
+ */
+typedef struct asynccall {
+    DBusPendingCallNotifyFunction notify;
+    void *data;
+    DBusFreeFunction data_free;
+    /* set by whoever runs notify, so only one does */
+    volatile gint fired;
+} asynccall_t;
 
-      if (flags & DBUS_WATCH_READABLE) {
-          ev_type |= EV_READ;
-          w->cond |= XCDBUS_FD_COND_READ;
-      }
-      if (flags & DBUS_WATCH_WRITABLE) {
-          ev_type |= EV_WRITE;
-          w->cond |= XCDBUS_FD_COND_WRITE;
-      }
+static void
+async_notify (DBusPendingCall *pending, void *data)
+{
+    asynccall_t *a = (asynccall_t *) data;
+    if (g_atomic_int_compare_and_exchange (&a->fired, 0, 1))
+        a->notify (pending, a->data);
+}
 
-      /* integrate watch with select loop */
-      if (w->cond) {
-          w->dbw = watch;
-      }
+static void
+async_free (void *data)
+{
+    asynccall_t *a = (asynccall_t *) data;
+    if (a->data_free)
+        a->data_free (a->data);
+    g_free (a);
+}
+
+static int
+send_async (xcdbus_conn_t *c, DBusMessage *msg,
+            DBusPendingCallNotifyFunction notify, void *data, DBusFreeFunction data_free,
+            DBusPendingCall **ref)
+{
+    DBusPendingCall *pending = NULL;
+    asynccall_t *a;
 
-      event_set(&w->ev, w->fd, ev_type, event_cb, w);
-      event_add(&w->ev, NULL);
+    if (!dbus_connection_send_with_reply (c->conn, msg, &pending, BLOCKING_TIMEOUT) || !pending) {
+        if (data_free)
+            data_free (data);
+        return 0;
+    }
+    xcdbus_registry_lock ();
+    g_hash_table_insert (c->pending, pending, pending);
+    xcdbus_registry_unlock ();
+    if (ref)
+        *ref = dbus_pending_call_ref (pending);
+    if (!xcdbus_thread_safe ()) {
+        /* nothing completes it before we get back to the loop */
+        dbus_pending_call_set_notify (pending, notify, data, data_free);
+        return 1;
     }
 
-  return TRUE;
+    /* another thread dispatching may complete it before the notify is set,
+     * in which case libdbus never calls it */
+    a = g_new0 (asynccall_t, 1);
+    a->notify = notify;
+    a->data = data;
+    a->data_free = data_free;
+    dbus_pending_call_set_notify (pending, async_notify, a, async_free);
+    if (dbus_pending_call_get_completed (pending))
+        async_notify (pending, a);
+    return 1;
 }
 
 static void
-watch_remove_event (DBusWatch * watch, void *_c)
+pending_done (xcdbus_conn_t *c, DBusPendingCall *pending)
 {
-  xcdbus_conn_t *c = (xcdbus_conn_t *) _c;
-  int fd = dbus_watch_get_unix_fd (watch);
-  int cond = 0;
-  xcdbus_watch_t *w = find_watch_by_fd (c, fd, 0);
-  if (!w) return;
-
-  int flags = dbus_watch_get_flags(watch);
-  if (flags & DBUS_WATCH_READABLE) cond |= XCDBUS_FD_COND_READ;
-  if (flags & DBUS_WATCH_WRITABLE) cond |= XCDBUS_FD_COND_WRITE;
-  /* deintegrate from select loop */
-  w->cond &= ~cond;
-  if (!w->cond) {
-      w->dbw = NULL;
-  }
-  event_del(&w->ev);
+    xcdbus_registry_lock ();
+    g_hash_table_remove (c->pending, pending);
+    xcdbus_registry_unlock ();
+    dbus_pending_call_unref (pending);
 }
 
 static void
-watch_toggle_event (DBusWatch * watch, void *data)
+pending_cancel (gpointer key, gpointer value, gpointer data)
 {
-    if (dbus_watch_get_enabled (watch)) {
-        watch_add_event (watch, data);
-    }
-    else {
-        watch_remove_event (watch, data);
-    }
+    DBusPendingCall *pending = (DBusPendingCall *) key;
+    dbus_pending_call_cancel (pending);
+    dbus_pending_call_unref (pending);
 }
 
-EXTERNAL xcdbus_conn_t *
-xcdbus_init_event(const char *service_name, DBusGConnection *connG)
+static void
+connpool_unref (void *data)
 {
-  xcdbus_conn_t *c = xcdbus_init_common(service_name, connG, 0);
-  /* setup watching */
-  dbus_connection_set_watch_functions (
-      c->conn,
-      watch_add_event,
-      watch_remove_event,
-      watch_toggle_event,
-      c, NULL);
+    connpool_t *pool = (connpool_t *) data;
+    int i;
 
-  return c;
+    if (!g_atomic_int_dec_and_test (&pool->refs))
+        return;
+    for (i = 0; i < pool->n; ++i) {
+        dbus_connection_close (pool->v[i].conn);
+        dbus_connection_unref (pool->v[i].conn);
+    }
+    xcdbus_xfree (pool);
 }
-#else /* !HAVE_LIBEVENT */
-EXTERNAL xcdbus_conn_t *
-xcdbus_init_event(const char *service_name, DBusGConnection *connG)
+
+/* the connection pool with a reference held, NULL if there is none */
+static connpool_t *
+connpool_get (xcdbus_conn_t *c)
 {
-  return NULL;
+    connpool_t *pool;
+    int r;
+
+    r = xcdbus_read_begin ();
+    pool = (connpool_t *) g_atomic_pointer_get (&c->pool);
+    if (pool)
+        g_atomic_int_inc (&pool->refs);
+    xcdbus_read_end (r);
+    return pool;
 }
-#endif
 
-EXTERNAL DBusGConnection *xcdbus_get_dbus_glib_connection(xcdbus_conn_t *c)
+/* replace the pool, c's reference to the old one goes once nobody can
+ * be picking it up anymore */
+static void
+connpool_publish (xcdbus_conn_t *c, connpool_t *pool)
 {
-    return c->connG;
+    connpool_t *old;
+
+    xcdbus_registry_lock ();
+    old = c->pool;
+    g_atomic_pointer_set (&c->pool, pool);
+    if (old)
+        xcdbus_retire (connpool_unref, old);
+    xcdbus_registry_unlock ();
 }
 
-EXTERNAL DBusConnection *xcdbus_get_dbus_connection(xcdbus_conn_t * c)
+/* whether the calling thread is running a dispatch of c */
+static int
+in_dispatch (xcdbus_conn_t *c)
 {
-  return c->conn;
+    return c->dispatching && (!xcdbus_thread_safe () || c->dispatch_thread == g_thread_self ());
 }
 
-EXTERNAL void
-xcdbus_shutdown (xcdbus_conn_t * c)
+/* report a blocking call if it held up the dispatch loop */
+static void
+stall_check (xcdbus_conn_t *c, const char *destination, const char *method, int64_t us)
 {
-  if (!c)
-    return;
+#ifdef HAVE_EXECINFO_H
+    void *frames[STALL_FRAMES];
+#endif
+    xcdbus_stall_t st;
+    int dispatching;
 
-  if (c->watches)
-    xcdbus_xfree (c->watches);
+    if (!c || !c->stall_watch)
+        return;
+    dispatching = in_dispatch (c);
+    if (!dispatching && !(c->stall_ms && us >= (int64_t) c->stall_ms * 1000))
+        return;
 
-  xcdbus_xfree (c);
+    xcdbus_stats_stall (destination, method);
+    if (!c->stall_cb)
+        return;
+    memset (&st, 0, sizeof (st));
+    st.destination = destination ? destination : "";
+    st.method = method ? method : "";
+    st.us = us;
+    st.in_dispatch = dispatching;
+#ifdef HAVE_EXECINFO_H
+    st.nframes = backtrace (frames, STALL_FRAMES);
+    st.frames = frames;
+#endif
+    c->stall_cb (c, &st, c->stall_priv);
 }
 
-/* test if service of given name is published on dbus already */
-EXTERNAL int
-xcdbus_name_has_owner (xcdbus_conn_t * c, const char *service)
+/* account a blocking call which started at xcdbus_now_us() start */
+static void
+stats_call (DBusMessage *msg, DBusMessage *reply, DBusError *error, int64_t start)
+{
+    int outcome = XCDBUS_STATS_OK;
+
+    if (!reply)
+        outcome = dbus_error_has_name (error, DBUS_ERROR_NO_REPLY) ||
+                  dbus_error_has_name (error, DBUS_ERROR_TIMEOUT) ?
+                  XCDBUS_STATS_TIMEOUT : XCDBUS_STATS_ERROR;
+    xcdbus_stats_record (dbus_message_get_destination (msg), dbus_message_get_member (msg),
+                         xcdbus_now_us () - start, outcome,
+                         xcdbus_stats_message_bytes (msg), xcdbus_stats_message_bytes (reply));
+}
+
+/* account a blocking call of c (can be NULL) made through dbus-glib */
+static void
+stats_gcall (xcdbus_conn_t *c, const char *service, const char *method, int ok, GError *error, int64_t start)
+{
+    int outcome = XCDBUS_STATS_OK;
+    int64_t us = xcdbus_now_us () - start;
+
+    if (!ok)
+        outcome = error && error->domain == DBUS_GERROR && error->code == DBUS_GERROR_NO_REPLY ?
+                  XCDBUS_STATS_TIMEOUT : XCDBUS_STATS_ERROR;
+    xcdbus_stats_record (service, method, us, outcome, 0, 0);
+    stall_check (c, service, method, us);
+}
+
+/* blocking call of c on conn, its own or a pooled one */
+static DBusMessage *
+send_blocking (xcdbus_conn_t *c, DBusConnection *conn, DBusMessage *msg)
+{
+    DBusMessage *reply;
+    DBusError error;
+    int64_t start;
+
+    if (!xcdbus_stats_enabled () && !c->stall_watch)
+        return dbus_connection_send_with_reply_and_block (conn, msg, BLOCKING_TIMEOUT, NULL);
+    start = xcdbus_now_us ();
+    dbus_error_init (&error);
+    reply = dbus_connection_send_with_reply_and_block (conn, msg, BLOCKING_TIMEOUT, &error);
+    /* may be here for the stall watch alone */
+    if (xcdbus_stats_enabled ())
+        stats_call (msg, reply, &error, start);
+    stall_check (c, dbus_message_get_destination (msg), dbus_message_get_member (msg),
+                 xcdbus_now_us () - start);
+    dbus_error_free (&error);
+    return reply;
+}
+
+/*
+ * reply of a call to method of destination, one of several sent together
+ * at start, blocking until it is in; accounted like send_blocking. Drops
+ * the pending call.
+ */
+static DBusMessage *
+pending_reply (DBusPendingCall *pending, const char *destination, const char *method, int64_t start)
+{
+    DBusMessage *reply;
+    const char *name;
+    int outcome = XCDBUS_STATS_OK;
+
+    /* reads the socket until this reply is in, without dispatching */
+    dbus_pending_call_block (pending);
+    reply = dbus_pending_call_steal_reply (pending);
+    dbus_pending_call_unref (pending);
+    if (!xcdbus_stats_enabled ())
+        return reply;
+    if (!reply || dbus_message_get_type (reply) == DBUS_MESSAGE_TYPE_ERROR) {
+        name = reply ? dbus_message_get_error_name (reply) : NULL;
+        outcome = !name || !strcmp (name, DBUS_ERROR_NO_REPLY) || !strcmp (name, DBUS_ERROR_TIMEOUT) ?
+                  XCDBUS_STATS_TIMEOUT : XCDBUS_STATS_ERROR;
+    }
+    xcdbus_stats_record (destination, method, xcdbus_now_us () - start, outcome,
+                         0, xcdbus_stats_message_bytes (reply));
+    return reply;
+}
+
+/*
+ * send a method call and wait for its reply, on the pooled connection with
+ * the fewest calls in flight, or the shared one without a pool. NULL on
+ * error or timeout.
+ */
+static DBusMessage *
+call_blocking (xcdbus_conn_t *c, DBusMessage *msg)
+{
+    connpool_t *pool = connpool_get (c);
+    poolconn_t *pc;
+    DBusMessage *reply;
+    int i, start;
+
+    if (!pool)
+        return send_blocking (c, c->conn, msg);
+
+    /* equally busy connections take turns */
+    g_atomic_int_inc (&pool->next);
+    start = (guint) g_atomic_int_get (&pool->next) % pool->n;
+    pc = &pool->v[start];
+    for (i = 1; i < pool->n; ++i) {
+        poolconn_t *o = &pool->v[(start + i) % pool->n];
+        if (g_atomic_int_get (&o->inflight) < g_atomic_int_get (&pc->inflight))
+            pc = o;
+    }
+
+    g_atomic_int_inc (&pc->inflight);
+    reply = send_blocking (c, pc->conn, msg);
+    g_atomic_int_add (&pc->inflight, -1);
+    /* nothing else reads a pooled connection: what the blocking call left
+     * queued, NameAcquired or late replies, would pile up */
+    dbus_connection_read_write_dispatch (pc->conn, 0);
+    while (dbus_connection_get_dispatch_status (pc->conn) == DBUS_DISPATCH_DATA_REMAINS)
+        dbus_connection_dispatch (pc->conn);
+    connpool_unref (pool);
+    return reply;
+}
+
+static void
+proxy_entry_release (void *data)
+{
+    proxyentry_t *e = (proxyentry_t *) data;
+    xcdbus_xfree (e->key);
+    xcdbus_xfree (e);
+}
+
+/* at shutdown, when nobody may use the proxy any more */
+static void
+proxy_entry_free (gpointer data)
+{
+    proxyentry_t *e = (proxyentry_t *) data;
+    if (e->proxy)
+        g_object_unref (e->proxy);
+    e->proxy = NULL;
+    if (xcdbus_thread_safe ()) {
+        /* the published snapshot may still hold it */
+        e->c->proxy_dead = g_list_prepend (e->c->proxy_dead, e);
+        return;
+    }
+    proxy_entry_release (e);
+}
+
+static void
+hash_table_release (void *data)
+{
+    g_hash_table_destroy ((GHashTable *) data);
+}
+
+static void
+hash_table_copy_entry (gpointer key, gpointer value, gpointer data)
+{
+    g_hash_table_insert ((GHashTable *) data, key, value);
+}
+
+/* thread-safe mode: let lock-free lookups see proxies as they are now */
+static void
+proxy_cache_publish (xcdbus_conn_t *c)
+{
+    GHashTable *snap, *old = c->proxy_snap;
+
+    if (!xcdbus_thread_safe ())
+        return;
+    snap = g_hash_table_new (g_str_hash, g_str_equal);
+    g_hash_table_foreach (c->proxies, hash_table_copy_entry, snap);
+    g_atomic_pointer_set (&c->proxy_snap, snap);
+    if (old)
+        xcdbus_retire (hash_table_release, old);
+    while (c->proxy_dead) {
+        xcdbus_retire (proxy_entry_release, c->proxy_dead->data);
+        c->proxy_dead = g_list_delete_link (c->proxy_dead, c->proxy_dead);
+    }
+}
+
+/* OWNER_* of a name, OWNER_UNKNOWN if not watched */
+static int
+name_owner_state (xcdbus_conn_t *c, const char *name)
+{
+    nameowner_t *o;
+    int state;
+
+    xcdbus_registry_lock ();
+    o = g_hash_table_lookup (c->owners, name);
+    state = o ? o->state : OWNER_UNKNOWN;
+    xcdbus_registry_unlock ();
+    return state;
+}
+
+static void
+sender_domid_free (gpointer data)
+{
+    senderdomid_t *d = (senderdomid_t *) data;
+    if (d->pending)
+        dbus_pending_call_unref (d->pending);
+    g_free (d);
+}
+
+static void
+name_owner_free (gpointer data)
+{
+    nameowner_t *o = (nameowner_t *) data;
+    g_free (o->owner);
+    g_free (o);
+}
+
+static void
+name_owner_set (nameowner_t *o, const char *owner)
+{
+    g_free (o->owner);
+    o->owner = owner && owner[0] ? g_strdup (owner) : NULL;
+    o->state = o->owner ? OWNER_SET : OWNER_NONE;
+}
+
+typedef struct servicewait {
+    xcdbus_conn_t *c;
+    char *name;
+    xcdbus_service_cb cb;
+    void *priv;
+    xcdbus_timeout_t *timer;
+} servicewait_t;
+
+static void
+service_wait_free (servicewait_t *w)
+{
+    g_free (w->name);
+    g_free (w);
+}
+
+static void
+service_wait_timeout (void *data)
+{
+    servicewait_t *w = (servicewait_t *) data;
+    xcdbus_conn_t *c = w->c;
+
+    /* the timer frees itself */
+    w->timer = NULL;
+    c->service_waits = g_list_remove (c->service_waits, w);
+    w->cb (c, w->name, 0, w->priv);
+    service_wait_free (w);
+}
+
+/* complete waiters of a name which got an owner */
+static void
+service_waits_check (xcdbus_conn_t *c, const char *name, nameowner_t *o)
+{
+    GList *l, *next;
+
+    if (o->state != OWNER_SET)
+        return;
+    for (l = c->service_waits; l; l = next) {
+        servicewait_t *w = (servicewait_t *) l->data;
+        next = l->next;
+        if (strcmp (w->name, name))
+            continue;
+        c->service_waits = g_list_delete_link (c->service_waits, l);
+        timer_cancel (c, w->timer);
+        w->cb (c, w->name, 1, w->priv);
+        service_wait_free (w);
+        /* the callback may have changed the list */
+        next = c->service_waits;
+    }
+}
+
+static void
+props_release (void *data)
+{
+    xcdbus_props_free ((xcdbus_props_t *) data);
+}
+
+/*
+ * mirrors are set up on the dispatching thread, but their properties are
+ * read from any: replace them with the lock held, readers of the old ones
+ * keep them until done
+ */
+static void
+mirror_set_props (propmirror_t *pm, xcdbus_props_t *p)
+{
+    if (pm->props)
+        xcdbus_retire (props_release, pm->props);
+    pm->props = p;
+}
+
+/* with the lock held */
+static void
+mirror_free (gpointer data)
+{
+    propmirror_t *pm = (propmirror_t *) data;
+    dbus_bus_remove_match (pm->c->conn, pm->rule, NULL);
+    mirror_set_props (pm, NULL);
+    g_free (pm->key);
+    g_free (pm->service);
+    g_free (pm->objpath);
+    g_free (pm->interface);
+    g_free (pm->rule);
+    g_free (pm);
+}
+
+/* whether sender speaks for a service we watch the owner of */
+static int
+sent_by_owner (xcdbus_conn_t *c, const char *service, const char *sender)
+{
+    nameowner_t *o;
+    int ok;
+
+    if (!sender)
+        return 0;
+    xcdbus_registry_lock ();
+    o = g_hash_table_lookup (c->owners, service);
+    if (o && o->state == OWNER_SET)
+        ok = !strcmp (o->owner, sender);
+    else
+        ok = o && o->state == OWNER_UNKNOWN;
+    xcdbus_registry_unlock ();
+    return ok;
+}
+
+/* tell the callback of pm which properties a PropertiesChanged touched */
+static void
+mirror_notify (xcdbus_conn_t *c, propmirror_t *pm, DBusMessage *m)
+{
+    DBusMessageIter iter, sub, entry;
+    const char *name;
+
+    dbus_message_iter_init (m, &iter);
+    dbus_message_iter_next (&iter);
+    dbus_message_iter_recurse (&iter, &sub);
+    for (; dbus_message_iter_get_arg_type (&sub) == DBUS_TYPE_DICT_ENTRY;
+         dbus_message_iter_next (&sub)) {
+        dbus_message_iter_recurse (&sub, &entry);
+        dbus_message_iter_get_basic (&entry, &name);
+        pm->cb (c, pm->service, pm->objpath, pm->interface, name, pm->priv);
+    }
+    dbus_message_iter_next (&iter);
+    dbus_message_iter_recurse (&iter, &sub);
+    for (; dbus_message_iter_get_arg_type (&sub) == DBUS_TYPE_STRING;
+         dbus_message_iter_next (&sub)) {
+        dbus_message_iter_get_basic (&sub, &name);
+        pm->cb (c, pm->service, pm->objpath, pm->interface, name, pm->priv);
+    }
+}
+
+static void
+mirrors_changed (xcdbus_conn_t *c, DBusMessage *m)
+{
+    const char *path = dbus_message_get_path (m);
+    const char *sender = dbus_message_get_sender (m);
+    const char *interface = NULL;
+    GHashTableIter it;
+    gpointer value;
+
+    if (!path || !dbus_message_has_signature (m, "sa{sv}as"))
+        return;
+    if (!dbus_message_get_args (m, NULL, DBUS_TYPE_STRING, &interface, DBUS_TYPE_INVALID))
+        return;
+
+    /* mirrors are few, a scan beats keying them by sender too */
+    g_hash_table_iter_init (&it, c->mirrors);
+    while (g_hash_table_iter_next (&it, NULL, &value)) {
+        propmirror_t *pm = (propmirror_t *) value;
+        if (strcmp (pm->objpath, path) || strcmp (pm->interface, interface) ||
+            !sent_by_owner (c, pm->service, sender))
+            continue;
+        xcdbus_registry_lock ();
+        if (pm->props)
+            mirror_set_props (pm, xcdbus_props_update (pm->props, m));
+        xcdbus_registry_unlock ();
+        if (pm->cb)
+            mirror_notify (c, pm, m);
+    }
+}
+
+/* what a previous owner told us is no longer true */
+static void
+mirrors_owner_changed (xcdbus_conn_t *c, const char *name)
+{
+    GHashTableIter it;
+    gpointer value;
+
+    g_hash_table_iter_init (&it, c->mirrors);
+    while (g_hash_table_iter_next (&it, NULL, &value)) {
+        propmirror_t *pm = (propmirror_t *) value;
+        if (strcmp (pm->service, name))
+            continue;
+        xcdbus_registry_lock ();
+        mirror_set_props (pm, NULL);
+        pm->getall_failed = 0;
+        xcdbus_registry_unlock ();
+        if (pm->cb)
+            pm->cb (c, pm->service, pm->objpath, pm->interface, NULL, pm->priv);
+    }
+}
+
+static void
+focus_set (xcdbus_conn_t *c, int32_t domid)
+{
+    int changed = !c->focus_known || c->focus_domid != domid;
+
+    c->focus_known = 1;
+    c->focus_domid = domid;
+    if (changed && c->focus_cb)
+        c->focus_cb (c, domid, c->focus_priv);
+}
+
+static void
+focus_query_notify (DBusPendingCall *pending, void *data)
+{
+    xcdbus_conn_t *c = (xcdbus_conn_t *) data;
+    DBusMessage *reply = dbus_pending_call_steal_reply (pending);
+    int32_t domid;
+
+    /* replies come after the signals sent before them, so this is current */
+    if (reply && dbus_message_get_type (reply) == DBUS_MESSAGE_TYPE_METHOD_RETURN &&
+        dbus_message_get_args (reply, NULL, DBUS_TYPE_INT32, &domid, DBUS_TYPE_INVALID))
+        focus_set (c, domid);
+
+    if (reply)
+        dbus_message_unref (reply);
+    pending_done (c, pending);
+}
+
+/* ask the input daemon once, signals take over from there */
+static void
+focus_query (xcdbus_conn_t *c)
+{
+    DBusMessage *msg = dbus_message_new_method_call (INPUT_SERVICE, INPUT_OBJ, INPUT_INTERFACE,
+                                                     "get_focus_domid");
+    if (!msg)
+        return;
+    send_async (c, msg, focus_query_notify, c, NULL, NULL);
+    dbus_message_unref (msg);
+}
+
+/* a new input daemon knows nothing of what the previous one said */
+static void
+focus_owner_changed (xcdbus_conn_t *c, const char *name)
+{
+    if (!c->focus_tracking || strcmp (name, INPUT_SERVICE))
+        return;
+    c->focus_known = 0;
+    if (name_owner_state (c, name) == OWNER_SET)
+        focus_query (c);
+}
+
+static void vm_refresh (xcdbus_conn_t *c);
+
+static void
+vm_domids_release (void *data)
+{
+    g_hash_table_destroy ((GHashTable *) data);
+}
+
+/*
+ * replace the tracked domain set by the n domids of ids; only the
+ * dispatching thread does, readers may be on any
+ */
+static void
+vm_domids_set (xcdbus_conn_t *c, const int32_t *ids, int n)
+{
+    GHashTable *old = c->vm_domids;
+    GHashTable *set = g_hash_table_new (g_direct_hash, g_direct_equal);
+    GHashTableIter it;
+    gpointer key;
+    int i;
+
+    for (i = 0; i < n; ++i)
+        g_hash_table_insert (set, GINT_TO_POINTER (ids[i]), GINT_TO_POINTER (1));
+    xcdbus_registry_lock ();
+    g_atomic_pointer_set (&c->vm_domids, set);
+    g_atomic_int_set (&c->vm_known, 1);
+    xcdbus_registry_unlock ();
+
+    if (c->vm_cb) {
+        for (i = 0; i < n; ++i)
+            if (!g_hash_table_lookup (old, GINT_TO_POINTER (ids[i])))
+                c->vm_cb (c, ids[i], 1, c->vm_priv);
+        g_hash_table_iter_init (&it, old);
+        while (g_hash_table_iter_next (&it, &key, NULL))
+            if (!g_hash_table_lookup (set, key))
+                c->vm_cb (c, GPOINTER_TO_INT (key), 0, c->vm_priv);
+    }
+    xcdbus_registry_lock ();
+    xcdbus_retire (vm_domids_release, old);
+    xcdbus_registry_unlock ();
+}
+
+/* the running domids if known, NULL if not; within xcdbus_read_begin/end */
+static GHashTable *
+vm_domids_peek (xcdbus_conn_t *c)
+{
+    if (!g_atomic_int_get (&c->vm_known))
+        return NULL;
+    return (GHashTable *) g_atomic_pointer_get (&c->vm_domids);
+}
+
+static void
+vm_refresh_notify (DBusPendingCall *pending, void *data)
+{
+    xcdbus_conn_t *c = (xcdbus_conn_t *) data;
+    DBusMessage *reply = dbus_pending_call_steal_reply (pending);
+    int32_t *ids;
+    int n;
+
+    c->vm_refresh = 0;
+    if (reply && dbus_message_get_type (reply) == DBUS_MESSAGE_TYPE_METHOD_RETURN &&
+        dbus_message_get_args (reply, NULL, DBUS_TYPE_ARRAY, DBUS_TYPE_INT32, &ids, &n,
+                               DBUS_TYPE_INVALID))
+        vm_domids_set (c, ids, n);
+
+    if (reply)
+        dbus_message_unref (reply);
+    pending_done (c, pending);
+    /* changes came in while asking, the answer may predate them */
+    if (c->vm_refresh_again) {
+        c->vm_refresh_again = 0;
+        vm_refresh (c);
+    }
+}
+
+/*
+ * vm_state_changed names the vm, not its domain, so the set is re-read;
+ * bursts of changes share one list_domids in flight
+ */
+static void
+vm_refresh (xcdbus_conn_t *c)
+{
+    DBusMessage *msg;
+
+    if (c->vm_refresh) {
+        c->vm_refresh_again = 1;
+        return;
+    }
+    msg = dbus_message_new_method_call (XENMGR_SERVICE, XENMGR_OBJ, XENMGR_INTERFACE, "list_domids");
+    if (!msg)
+        return;
+    c->vm_refresh = send_async (c, msg, vm_refresh_notify, c, NULL, NULL);
+    dbus_message_unref (msg);
+}
+
+static void
+vm_owner_changed (xcdbus_conn_t *c, const char *name)
+{
+    if (!c->vm_tracking || strcmp (name, XENMGR_SERVICE))
+        return;
+    g_atomic_int_set (&c->vm_known, 0);
+    if (name_owner_state (c, name) == OWNER_SET)
+        vm_refresh (c);
+}
+
+static void db_cache_invalidate (xcdbus_conn_t *c, const char *path);
+
+/* a name we watch changed owner */
+static void
+name_owner_changed (xcdbus_conn_t *c, const char *name)
+{
+    mirrors_owner_changed (c, name);
+    focus_owner_changed (c, name);
+    vm_owner_changed (c, name);
+    if (c->dbcache && !strcmp (name, DB_SERVICE))
+        db_cache_invalidate (c, NULL);
+}
+
+static void domid_prefetch (xcdbus_conn_t *xc, const char *sender);
+
+/* remember m as the message handlers are being called for */
+static void
+current_message_set (xcdbus_conn_t *c, DBusMessage *m)
+{
+    if (c->current_ctx) {
+        xcdbus_msg_ctx_unref (c->current_ctx);
+        c->current_ctx = NULL;
+    }
+    if (m)
+        dbus_message_ref (m);
+    if (c->current)
+        dbus_message_unref (c->current);
+    c->current = m;
+}
+
+static gboolean
+current_clear_cb (gpointer data)
+{
+    xcdbus_conn_t *c = (xcdbus_conn_t *) data;
+
+    g_source_unref (c->current_clear);
+    c->current_clear = NULL;
+    current_message_set (c, NULL);
+    return FALSE;
+}
+
+static DBusHandlerResult
+xcdbus_filter (DBusConnection *conn, DBusMessage *m, void *data)
+{
+    xcdbus_conn_t *c = (xcdbus_conn_t *) data;
+
+    /* filters run before the object handlers, whatever the main loop */
+    current_message_set (c, m);
+    if (c->backend == BACKEND_GLIB && !c->current_clear) {
+        /* dbus-glib dispatches a message per iteration, this runs in between */
+        c->current_clear = g_idle_source_new ();
+        g_source_set_priority (c->current_clear, G_PRIORITY_HIGH);
+        g_source_set_callback (c->current_clear, current_clear_cb, c, NULL);
+        g_source_attach (c->current_clear, c->gctx);
+    }
+    if (c->domids_prefetch && dbus_message_get_type (m) == DBUS_MESSAGE_TYPE_METHOD_CALL) {
+        const char *sender = dbus_message_get_sender (m);
+        if (sender && sender[0] == ':')
+            domid_prefetch (c, sender);
+    }
+
+    if (dbus_message_is_signal (m, "org.freedesktop.DBus", "NameOwnerChanged")) {
+        const char *name = NULL, *old_owner = NULL, *new_owner = NULL;
+        nameowner_t *o;
+        if (!dbus_message_get_args (m, NULL,
+                                    DBUS_TYPE_STRING, &name,
+                                    DBUS_TYPE_STRING, &old_owner,
+                                    DBUS_TYPE_STRING, &new_owner,
+                                    DBUS_TYPE_INVALID))
+            return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+        xcdbus_registry_lock ();
+        if ((o = g_hash_table_lookup (c->owners, name)))
+            name_owner_set (o, new_owner);
+        xcdbus_registry_unlock ();
+        /* entries stay until shutdown, o is safe to use unlocked */
+        if (o) {
+            name_owner_changed (c, name);
+            service_waits_check (c, name, o);
+        }
+        /* unique names are never reused, forget the domid of a gone one */
+        if (name[0] == ':' && !new_owner[0]) {
+            xcdbus_registry_lock ();
+            g_hash_table_remove (c->domids, name);
+            xcdbus_registry_unlock ();
+        }
+    } else if (c->focus_tracking &&
+               dbus_message_is_signal (m, INPUT_INTERFACE, INPUT_FOCUS_SIGNAL) &&
+               sent_by_owner (c, INPUT_SERVICE, dbus_message_get_sender (m))) {
+        int32_t domid;
+        if (dbus_message_get_args (m, NULL, DBUS_TYPE_INT32, &domid, DBUS_TYPE_INVALID))
+            focus_set (c, domid);
+    } else if (c->vm_tracking &&
+               dbus_message_is_signal (m, XENMGR_INTERFACE, XENMGR_VM_STATE_SIGNAL) &&
+               sent_by_owner (c, XENMGR_SERVICE, dbus_message_get_sender (m))) {
+        vm_refresh (c);
+    } else if (g_hash_table_size (c->mirrors) &&
+               dbus_message_is_signal (m, "org.freedesktop.DBus.Properties", "PropertiesChanged")) {
+        mirrors_changed (c, m);
+    }
+    /* other filters and handlers may want it too */
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+static char *
+owner_match_rule (const char *name)
+{
+    return g_strdup_printf ("type='signal',sender='org.freedesktop.DBus',"
+                            "interface='org.freedesktop.DBus',"
+                            "member='NameOwnerChanged',arg0='%s'", name);
+}
+
+typedef struct namequery {
+    xcdbus_conn_t *c;
+    char *name;
+} namequery_t;
+
+static void
+name_query_free (void *data)
+{
+    namequery_t *q = (namequery_t *) data;
+    g_free (q->name);
+    g_free (q);
+}
+
+static void
+owner_query_notify (DBusPendingCall *pending, void *data)
+{
+    namequery_t *q = (namequery_t *) data;
+    DBusMessage *reply = dbus_pending_call_steal_reply (pending);
+    nameowner_t *o;
+    const char *owner = NULL;
+
+    xcdbus_registry_lock ();
+    o = g_hash_table_lookup (q->c->owners, q->name);
+    if (o && reply) {
+        /* the NameHasOwner error means there is none */
+        if (dbus_message_get_type (reply) != DBUS_MESSAGE_TYPE_METHOD_RETURN ||
+            !dbus_message_get_args (reply, NULL, DBUS_TYPE_STRING, &owner, DBUS_TYPE_INVALID))
+            owner = NULL;
+        /* bus replies and signals arrive in order, this is the latest word */
+        name_owner_set (o, owner);
+    }
+    xcdbus_registry_unlock ();
+    if (o && reply)
+        service_waits_check (q->c, q->name, o);
+
+    if (reply)
+        dbus_message_unref (reply);
+    pending_done (q->c, pending);
+}
+
+/* subscribe to owner changes of given name, once per connection, and
+ * seed its owner without waiting for the answer */
+static void
+watch_name_owner (xcdbus_conn_t *c, const char *name)
+{
+    DBusMessage *msg;
+    namequery_t *q;
+    nameowner_t *o;
+    char *rule;
+
+    xcdbus_registry_lock ();
+    if (g_hash_table_lookup (c->owners, name)) {
+        xcdbus_registry_unlock ();
+        return;
+    }
+    o = g_new0 (nameowner_t, 1);
+    o->state = OWNER_UNKNOWN;
+    g_hash_table_insert (c->owners, g_strdup (name), o);
+    xcdbus_registry_unlock ();
+
+    rule = owner_match_rule (name);
+    /* no error argument, so this does not block on a reply */
+    dbus_bus_add_match (c->conn, rule, NULL);
+    g_free (rule);
+
+    msg = dbus_message_new_method_call ("org.freedesktop.DBus",
+                                        "/org/freedesktop/DBus",
+                                        "org.freedesktop.DBus", "GetNameOwner");
+    if (!msg)
+        return;
+    if (dbus_message_append_args (msg, DBUS_TYPE_STRING, &name, DBUS_TYPE_INVALID)) {
+        q = g_new0 (namequery_t, 1);
+        q->c = c;
+        q->name = g_strdup (name);
+        send_async (c, msg, owner_query_notify, q, name_query_free, NULL);
+    }
+    dbus_message_unref (msg);
+}
+
+static void
+unwatch_name_owner (gpointer key, gpointer value, gpointer data)
+{
+    xcdbus_conn_t *c = (xcdbus_conn_t *) data;
+    char *rule = owner_match_rule ((const char *) key);
+    dbus_bus_remove_match (c->conn, rule, NULL);
+    g_free (rule);
+}
+
+/* xcdbus_conn_t* of either DBusConnection*, DBusGConnection* or xcdbus_conn_t* */
+EXTERNAL
+xcdbus_conn_t *xcdbus_of_conn(void *c)
+{
+    GHashTable *t;
+    xcdbus_conn_t *xc = NULL;
+    int r;
+
+    if (!c) {
+        return NULL;
+    }
+    r = xcdbus_read_begin();
+    t = g_atomic_pointer_get(&connections);
+    if (t) {
+        xc = g_hash_table_lookup(t, c);
+    }
+    xcdbus_read_end(r);
+    return xc;
+}
+
+/* writable copy of the registry, with the lock held */
+static GHashTable *
+connections_copy (void)
+{
+  GHashTable *t = g_hash_table_new (g_direct_hash, g_direct_equal);
+  if (connections)
+    g_hash_table_foreach (connections, hash_table_copy_entry, t);
+  return t;
+}
+
+static void
+connections_publish (GHashTable *t)
+{
+  GHashTable *old = connections;
+  g_atomic_pointer_set (&connections, t);
+  if (old)
+    xcdbus_retire (hash_table_release, old);
+}
+
+static void
+register_connection (xcdbus_conn_t *c)
+{
+  GHashTable *t;
+
+  xcdbus_registry_lock ();
+  t = connections_copy ();
+  g_hash_table_insert (t, c, c);
+  /* several wrappers may share a connection, first one wins */
+  if (!g_hash_table_lookup (t, c->conn))
+    g_hash_table_insert (t, c->conn, c);
+  if (!g_hash_table_lookup (t, c->connG))
+    g_hash_table_insert (t, c->connG, c);
+  connections_publish (t);
+  xcdbus_registry_unlock ();
+}
+
+static void
+unregister_connection (xcdbus_conn_t *c)
+{
+  GHashTableIter it;
+  gpointer key, value;
+  xcdbus_conn_t *other = NULL;
+  GHashTable *t;
+
+  xcdbus_registry_lock ();
+  t = connections_copy ();
+  g_hash_table_remove (t, c);
+  if (g_hash_table_lookup (t, c->conn) == c)
+    {
+      /* hand the underlying connection over to another wrapper, if any */
+      g_hash_table_iter_init (&it, t);
+      while (g_hash_table_iter_next (&it, &key, &value))
+        {
+          xcdbus_conn_t *xc = (xcdbus_conn_t *) value;
+          if (key == xc && xc->conn == c->conn)
+            {
+              other = xc;
+              break;
+            }
+        }
+      if (other)
+        {
+          g_hash_table_insert (t, c->conn, other);
+          g_hash_table_insert (t, c->connG, other);
+        }
+      else
+        {
+          g_hash_table_remove (t, c->conn);
+          g_hash_table_remove (t, c->connG);
+        }
+    }
+  connections_publish (t);
+  xcdbus_registry_unlock ();
+}
+
+static xcdbus_conn_t *xcdbus_init_common(const char *service_name, DBusGConnection *connG, int gloop)
+{
+  DBusError error;
+  xcdbus_conn_t *c = NULL;
+  int ret = 0;
+
+  DBusConnection *conn = (DBusConnection*) dbus_g_connection_get_connection(connG);
+
+  if (service_name) {
+      dbus_error_init (&error);
+      ret =
+          dbus_bus_request_name (conn, service_name, DBUS_NAME_FLAG_DO_NOT_QUEUE,
+                                 &error);
+      if (ret == -1) {
+          dbus_error_free (&error);
+          return NULL;
+      }
+      dbus_error_free (&error);
+  }
+
+  c = xcdbus_xmalloc (sizeof (xcdbus_conn_t));
+  memset (c, 0, sizeof (*c));
+
+  c->connG = connG;
+  c->conn = conn;
+  c->watches = xcdbus_xmalloc (1);
+  c->nwatches = 0;
+  c->dispatching = 0;
+  c->gloop = gloop;
+  c->backend = BACKEND_SELECT;
+  c->epfd = -1;
+  c->evfd = -1;
+  c->tfd = -1;
+  c->proxies = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, proxy_entry_free);
+  g_queue_init (&c->batched);
+  c->owners = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, name_owner_free);
+  c->pending = g_hash_table_new (g_direct_hash, g_direct_equal);
+  c->domids = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, sender_domid_free);
+  c->mirrors = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, mirror_free);
+  c->vm_domids = g_hash_table_new (g_direct_hash, g_direct_equal);
+  dbus_connection_add_filter (conn, xcdbus_filter, c, NULL);
+
+  register_connection (c);
+  return c;
+}
+
+EXTERNAL xcdbus_conn_t *
+xcdbus_init(const char *service_name)
+{
+  DBusGConnection *conn = NULL;
+
+  conn = dbus_g_bus_get(DBUS_BUS_SYSTEM, NULL);
+  if (!conn) {
+      return NULL;
+  }
+  return xcdbus_init2(service_name, conn);
+}
+
+EXTERNAL xcdbus_conn_t * 
+xcdbus_init2(const char *service_name, DBusGConnection *connG)
+{
+  xcdbus_conn_t *c = xcdbus_init_common(service_name, connG, 0);
+  if (!c)
+    return NULL;
+
+  /* setup watching */
+  setup_main_loop (c, BACKEND_SELECT);
+
+  return c;
+}
+
+/* any of the arguments can be NULL */
+EXTERNAL xcdbus_conn_t *
+xcdbus_init_with_gloop(const char *service_name, DBusGConnection *conn, GMainLoop *loop)
+{
+    xcdbus_conn_t *c;
+    int gloop=0;
+    if (!conn) {
+        conn = dbus_g_bus_get(DBUS_BUS_SYSTEM, NULL);
+    }
+    if (!conn) {
+        return NULL;
+    }
+    if (loop) {
+        gloop=1;
+        dbus_connection_setup_with_g_main(dbus_g_connection_get_connection(conn), g_main_loop_get_context(loop));
+    }
+    /* DO NOT SETUP WATCH functions here, we assume glib's main loop takes care of that */
+    c = xcdbus_init_common(service_name, conn, gloop);
+    if (c) {
+        c->backend = BACKEND_GLIB;
+        c->gctx = loop ? g_main_loop_get_context(loop) : NULL;
+    }
+    return c;
+}
+
+#ifdef HAVE_LIBEVENT
+static void
+event_cb(int fd, short ev_type, void *priv)
+{
+  xcdbus_watch_t *w = (xcdbus_watch_t *)priv;
+  int watch_flags = 0;
+
+  if (ev_type & EV_READ)
+    {
+      watch_flags |= DBUS_WATCH_READABLE;
+    }
+  if (ev_type & EV_WRITE)
+    {
+      watch_flags |= DBUS_WATCH_WRITABLE;
+    }
+
+  if (watch_flags) {
+      watch_process (w->c, w, watch_flags);
+  }
+}
+
+static void
+timer_event_cb(int fd, short ev_type, void *priv)
+{
+  xcdbus_conn_t *c = (xcdbus_conn_t *) priv;
+  c->tev_added = 0;
+  timers_process (c);
+}
+
+static void
+dispatch_event_cb(int fd, short ev_type, void *priv)
+{
+  xcdbus_dispatch ((xcdbus_conn_t *) priv);
+}
+
+static void
+timers_sync_event (xcdbus_conn_t * c)
+{
+  xcdbus_timeout_t *t = xcdbus_timerheap_top (&c->timers);
+  struct timeval tv;
+  int64_t left;
+
+  if (c->tev_added)
+    {
+      event_del (&c->tev);
+      c->tev_added = 0;
+    }
+  if (!t)
+    return;
+
+  left = t->deadline - xcdbus_now_ms ();
+  if (left < 0)
+    left = 0;
+  tv.tv_sec = left / 1000;
+  tv.tv_usec = (left % 1000) * 1000;
+  event_add (&c->tev, &tv);
+  c->tev_added = 1;
+}
+
+static void
+watch_sync_event (xcdbus_watch_t * w)
+{
+  short ev_type = EV_PERSIST;
+
+  if (w->ev_added)
+    {
+      event_del (&w->ev);
+      w->ev_added = 0;
+    }
+  if (!w->cond)
+    return;
+
+  if (w->cond & XCDBUS_FD_COND_READ)
+    ev_type |= EV_READ;
+  if (w->cond & XCDBUS_FD_COND_WRITE)
+    ev_type |= EV_WRITE;
+
+  event_set (&w->ev, w->fd, ev_type, event_cb, w);
+  event_add (&w->ev, NULL);
+  w->ev_added = 1;
+}
+
+EXTERNAL xcdbus_conn_t *
+xcdbus_init_event(const char *service_name, DBusGConnection *connG)
+{
+  xcdbus_conn_t *c = xcdbus_init_common(service_name, connG, 0);
+  if (!c)
+    return NULL;
+
+  evtimer_set (&c->tev, timer_event_cb, c);
+  evtimer_set (&c->dev, dispatch_event_cb, c);
+  /* setup watching */
+  setup_main_loop (c, BACKEND_EVENT);
+
+  return c;
+}
+#else /* !HAVE_LIBEVENT */
+EXTERNAL xcdbus_conn_t *
+xcdbus_init_event(const char *service_name, DBusGConnection *connG)
+{
+  return NULL;
+}
+#endif
+
+#ifdef HAVE_SYS_EPOLL_H
+static void
+watch_sync_epoll (xcdbus_conn_t * c, xcdbus_watch_t * w)
+{
+  struct epoll_event ev;
+  int op;
+
+  if (w->cond == w->epoll_cond)
+    return;
+
+  memset (&ev, 0, sizeof (ev));
+  if (w->cond & XCDBUS_FD_COND_READ)
+    ev.events |= EPOLLIN;
+  if (w->cond & XCDBUS_FD_COND_WRITE)
+    ev.events |= EPOLLOUT;
+  ev.data.ptr = w;
+
+  if (!w->epoll_cond)
+    op = EPOLL_CTL_ADD;
+  else if (!w->cond)
+    op = EPOLL_CTL_DEL;
+  else
+    op = EPOLL_CTL_MOD;
+
+  /* fd may already be closed, in which case the kernel dropped it */
+  epoll_ctl (c->epfd, op, w->fd, &ev);
+  w->epoll_cond = w->cond;
+}
+
+static void
+timers_sync_epoll (xcdbus_conn_t * c)
+{
+  xcdbus_timeout_t *t = xcdbus_timerheap_top (&c->timers);
+  struct itimerspec its;
+
+  /* all zero disarms */
+  memset (&its, 0, sizeof (its));
+  if (t)
+    {
+      /* deadline is on the monotonic clock, like the timerfd */
+      its.it_value.tv_sec = t->deadline / 1000;
+      its.it_value.tv_nsec = (t->deadline % 1000) * 1000000;
+    }
+  timerfd_settime (c->tfd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+/* wake the epoll set up when messages sit in the queue without fd activity,
+ * e.g. read while waiting for a blocking reply */
+static void
+dispatch_status_epoll (DBusConnection * conn, DBusDispatchStatus status, void *_c)
+{
+  xcdbus_conn_t *c = (xcdbus_conn_t *) _c;
+  if (status == DBUS_DISPATCH_DATA_REMAINS)
+    eventfd_write (c->evfd, 1);
+}
+
+EXTERNAL xcdbus_conn_t *
+xcdbus_init_epoll(const char *service_name, DBusGConnection *connG)
+{
+  struct epoll_event ev;
+  xcdbus_conn_t *c = xcdbus_init_common(service_name, connG, 0);
+  if (!c)
+    return NULL;
+
+  c->epfd = epoll_create1 (EPOLL_CLOEXEC);
+  c->evfd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+  c->tfd = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (c->epfd < 0 || c->evfd < 0 || c->tfd < 0)
+    {
+      xcdbus_shutdown (c);
+      return NULL;
+    }
+
+  /* watches use their xcdbus_watch_t as cookie, these two their fd field */
+  memset (&ev, 0, sizeof (ev));
+  ev.events = EPOLLIN;
+  ev.data.ptr = &c->evfd;
+  epoll_ctl (c->epfd, EPOLL_CTL_ADD, c->evfd, &ev);
+  ev.data.ptr = &c->tfd;
+  epoll_ctl (c->epfd, EPOLL_CTL_ADD, c->tfd, &ev);
+
+  /* setup watching */
+  setup_main_loop (c, BACKEND_EPOLL);
+  dbus_connection_set_dispatch_status_function (c->conn, dispatch_status_epoll, c, NULL);
+  /* pick up anything queued before we were watching */
+  if (dbus_connection_get_dispatch_status (c->conn) == DBUS_DISPATCH_DATA_REMAINS)
+    eventfd_write (c->evfd, 1);
+
+  return c;
+}
+
+/* fd which becomes readable when xcdbus_process_epoll has work to do */
+EXTERNAL int
+xcdbus_get_epoll_fd(xcdbus_conn_t *c)
+{
+  return c->backend == BACKEND_EPOLL ? c->epfd : -1;
+}
+
+/* handle the watches which are ready, without blocking */
+EXTERNAL void
+xcdbus_process_epoll(xcdbus_conn_t *c)
+{
+  struct epoll_event evs[EPOLL_BATCH];
+  int n, i;
+
+  if (c->backend != BACKEND_EPOLL)
+    return;
+
+  n = epoll_wait (c->epfd, evs, EPOLL_BATCH, 0);
+  for (i = 0; i < n; ++i)
+    {
+      xcdbus_watch_t *w = (xcdbus_watch_t *) evs[i].data.ptr;
+      int watch_flags = 0;
+
+      if (evs[i].data.ptr == &c->evfd)
+        {
+          eventfd_t v;
+          eventfd_read (c->evfd, &v);
+          xcdbus_dispatch (c);
+          continue;
+        }
+      if (evs[i].data.ptr == &c->tfd)
+        {
+          uint64_t expirations;
+          if (read (c->tfd, &expirations, sizeof (expirations)) < 0)
+            {
+              /* spurious wakeup, nothing expired */
+            }
+          timers_process (c);
+          continue;
+        }
+      if (evs[i].events & EPOLLIN)
+        watch_flags |= DBUS_WATCH_READABLE;
+      if (evs[i].events & EPOLLOUT)
+        watch_flags |= DBUS_WATCH_WRITABLE;
+      if (evs[i].events & EPOLLERR)
+        watch_flags |= DBUS_WATCH_ERROR;
+      if (evs[i].events & EPOLLHUP)
+        watch_flags |= DBUS_WATCH_HANGUP;
+
+      if (watch_flags)
+        watch_process (c, w, watch_flags);
+    }
+}
+#else /* !HAVE_SYS_EPOLL_H */
+EXTERNAL xcdbus_conn_t *
+xcdbus_init_epoll(const char *service_name, DBusGConnection *connG)
+{
+  return NULL;
+}
+
+EXTERNAL int
+xcdbus_get_epoll_fd(xcdbus_conn_t *c)
+{
+  return -1;
+}
+
+EXTERNAL void
+xcdbus_process_epoll(xcdbus_conn_t *c)
+{
+}
+#endif
+
+/* have the I/O thread look at its watches, timers and queues again */
+static void
+io_thread_wakeup (xcdbus_conn_t * c)
+{
+  if (c->outq && g_thread_self () != c->io_thread)
+    xcdbus_ring_kick (c->outq);
+}
+
+/* messages read by a blocking call in a worker wait for the I/O thread */
+static void
+dispatch_status_thread (DBusConnection * conn, DBusDispatchStatus status, void *_c)
+{
+  if (status == DBUS_DISPATCH_DATA_REMAINS)
+    io_thread_wakeup ((xcdbus_conn_t *) _c);
+}
+
+/* pass method calls and signals on to the worker threads, runs after
+ * xcdbus_filter on the I/O thread */
+static DBusHandlerResult
+handoff_filter (DBusConnection *conn, DBusMessage *m, void *data)
+{
+    xcdbus_conn_t *c = (xcdbus_conn_t *) data;
+    int type = dbus_message_get_type (m);
+    void *object = NULL;
+
+    if (type == DBUS_MESSAGE_TYPE_METHOD_CALL) {
+        /* objects exported with dbus-glib are still served by it */
+        if (dbus_connection_get_object_path_data (conn, dbus_message_get_path (m), &object) && object)
+            return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+    } else if (type != DBUS_MESSAGE_TYPE_SIGNAL) {
+        return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+    }
+
+    dbus_message_ref (m);
+    /* keep the order when the workers fall behind */
+    if (c->in_backlog.length || !xcdbus_ring_push (c->inq, m))
+        g_queue_push_tail (&c->in_backlog, m);
+    /* the worker answers method calls; signals may have other takers */
+    return type == DBUS_MESSAGE_TYPE_METHOD_CALL ?
+        DBUS_HANDLER_RESULT_HANDLED : DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+static void
+io_backlog_flush (xcdbus_conn_t * c)
+{
+  while (c->in_backlog.length &&
+         xcdbus_ring_push (c->inq, g_queue_peek_head (&c->in_backlog)))
+    g_queue_pop_head (&c->in_backlog);
+}
+
+/* send what the workers queued */
+static void
+io_send_queued (xcdbus_conn_t * c)
+{
+  DBusMessage *m;
+
+  xcdbus_ring_drain (c->outq);
+  while ((m = (DBusMessage *) xcdbus_ring_pop (c->outq)))
+    {
+      dbus_connection_send (c->conn, m, NULL);
+      dbus_message_unref (m);
+    }
+}
+
+static gpointer
+io_thread_main (gpointer data)
+{
+  xcdbus_conn_t *c = (xcdbus_conn_t *) data;
+  int nfds = 8;
+  struct pollfd *fds = g_new (struct pollfd, nfds);
+
+  while (!g_atomic_int_get (&c->io_stop))
+    {
+      int n, timeout = -1;
+
+      io_backlog_flush (c);
+
+      /* the send queue first, then the connection's watches */
+      fds[0].fd = xcdbus_ring_fd (c->outq);
+      fds[0].events = POLLIN;
+      fds[0].revents = 0;
+      while ((n = xcdbus_pre_poll (c, fds + 1, nfds - 1, &timeout)) < 0)
+        {
+          nfds *= 2;
+          fds = g_renew (struct pollfd, fds, nfds);
+        }
+      /* the workers are behind: leave what comes next in the socket
+       * rather than queueing it here without bound */
+      if (c->in_backlog.length)
+        {
+          int i;
+          for (i = 1; i <= n; ++i)
+            fds[i].events &= ~POLLIN;
+        }
+      /* nothing tells us when workers make room */
+      if (c->in_backlog.length && (timeout < 0 || timeout > THREAD_BACKLOG_POLL))
+        timeout = THREAD_BACKLOG_POLL;
+
+      if (poll (fds, n + 1, timeout) < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          break;
+        }
+      if (fds[0].revents)
+        io_send_queued (c);
+      xcdbus_post_poll (c, fds + 1, n);
+    }
+
+  /* replies queued before the workers were stopped */
+  io_send_queued (c);
+  dbus_connection_flush (c->conn);
+  g_free (fds);
+  return NULL;
+}
+
+/*
+ * Connect to the system bus and leave reading, dispatching and writing to
+ * a thread of the library's own. Incoming method calls and signals are
+ * handed to any number of worker threads through xcdbus_threaded_receive,
+ * replies go out through xcdbus_threaded_send. Method calls to objects
+ * exported with dbus-glib are still dispatched to them, on the I/O thread.
+ * Other calls into the library can be made from any thread. Turns on
+ * xcdbus_thread_init. Do not drive the connection with a main loop.
+ */
+EXTERNAL xcdbus_conn_t *
+xcdbus_init_threaded(const char *service_name)
+{
+  DBusGConnection *connG;
+  xcdbus_conn_t *c;
+
+  xcdbus_thread_init ();
+  connG = dbus_g_bus_get (DBUS_BUS_SYSTEM, NULL);
+  if (!connG)
+    return NULL;
+  c = xcdbus_init_common (service_name, connG, 0);
+  if (!c)
+    return NULL;
+
+  g_queue_init (&c->in_backlog);
+  c->inq = xcdbus_ring_new (THREAD_QUEUE_SIZE, 0);
+  c->outq = xcdbus_ring_new (THREAD_QUEUE_SIZE, 1);
+  if (!c->inq || !c->outq)
+    {
+      xcdbus_shutdown (c);
+      return NULL;
+    }
+  dbus_connection_add_filter (c->conn, handoff_filter, c, NULL);
+
+  /* setup watching */
+  setup_main_loop (c, BACKEND_THREAD);
+  dbus_connection_set_dispatch_status_function (c->conn, dispatch_status_thread, c, NULL);
+
+#if GLIB_CHECK_VERSION(2,32,0)
+  c->io_thread = g_thread_new ("xcdbus-io", io_thread_main, c);
+#else
+  c->io_thread = g_thread_create (io_thread_main, c, TRUE, NULL);
+#endif
+  if (!c->io_thread)
+    {
+      xcdbus_shutdown (c);
+      return NULL;
+    }
+  return c;
+}
+
+/*
+ * Next method call or signal of a threaded connection, waiting up to
+ * timeout_ms for one (-1 for ever). The caller owns the message and
+ * answers method calls with xcdbus_threaded_send. NULL on timeout, and
+ * when woken up by xcdbus_threaded_wakeup.
+ */
+EXTERNAL DBusMessage *
+xcdbus_threaded_receive (xcdbus_conn_t * c, int timeout_ms)
+{
+  if (!c->inq)
+    return NULL;
+  return (DBusMessage *) xcdbus_ring_wait (c->inq, timeout_ms);
+}
+
+/* make one worker waiting in xcdbus_threaded_receive return, e.g. to stop */
+EXTERNAL void
+xcdbus_threaded_wakeup (xcdbus_conn_t * c)
+{
+  if (c->inq)
+    xcdbus_ring_kick (c->inq);
+}
+
+/*
+ * Have the I/O thread send msg, a reply or anything else; msg is not taken
+ * over. Messages go out in the order they were passed, waiting for room
+ * while the queue is full. 0 when out of memory.
+ */
+EXTERNAL int
+xcdbus_threaded_send (xcdbus_conn_t * c, DBusMessage * msg)
+{
+  if (!c->outq)
+    return dbus_connection_send (c->conn, msg, NULL) ? 1 : 0;
+
+  /* e.g. from a dbus-glib method: nobody else would empty the queue */
+  if (g_thread_self () == c->io_thread)
+    {
+      io_send_queued (c);
+      return dbus_connection_send (c->conn, msg, NULL) ? 1 : 0;
+    }
+  dbus_message_ref (msg);
+  while (!xcdbus_ring_push (c->outq, msg))
+    {
+      /* the I/O thread sends what is left once stopped */
+      if (g_atomic_int_get (&c->io_stop))
+        {
+          dbus_message_unref (msg);
+          return dbus_connection_send (c->conn, msg, NULL) ? 1 : 0;
+        }
+      g_usleep (THREAD_SEND_BACKOFF * 1000);
+    }
+  return 1;
+}
+
+/* after the I/O thread is gone */
+static void
+io_queues_free (xcdbus_conn_t * c)
+{
+  DBusMessage *m;
+
+  if (c->inq)
+    {
+      dbus_connection_remove_filter (c->conn, handoff_filter, c);
+      while ((m = (DBusMessage *) xcdbus_ring_pop (c->inq)))
+        dbus_message_unref (m);
+      while ((m = (DBusMessage *) g_queue_pop_head (&c->in_backlog)))
+        dbus_message_unref (m);
+      xcdbus_ring_free (c->inq);
+      c->inq = NULL;
+    }
+  if (c->outq)
+    {
+      while ((m = (DBusMessage *) xcdbus_ring_pop (c->outq)))
+        dbus_message_unref (m);
+      xcdbus_ring_free (c->outq);
+      c->outq = NULL;
+    }
+}
+
+EXTERNAL DBusGConnection *xcdbus_get_dbus_glib_connection(xcdbus_conn_t *c)
+{
+    return c->connG;
+}
+
+EXTERNAL DBusConnection *xcdbus_get_dbus_connection(xcdbus_conn_t * c)
+{
+  return c->conn;
+}
+
+/* pooled connections only make calls, anything else they get is dropped */
+static DBusHandlerResult
+pool_filter (DBusConnection * conn, DBusMessage * m, void *data)
+{
+  return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+/*
+ * Open n private connections to the system bus and spread the blocking
+ * calls of the library over them, each going to the one with the fewest
+ * calls in flight, so that threads making them do not queue up on the
+ * shared connection. n of 0 closes the pool. Calls which need dbus-glib,
+ * generated RPC wrappers among them, stay on the shared connection.
+ * Returns how many connections were opened.
+ */
+EXTERNAL int
+xcdbus_set_connection_pool (xcdbus_conn_t * c, int n)
+{
+  connpool_t *pool = NULL;
+  int i, opened = 0;
+
+  c = xcdbus_of_conn (c);
+  if (!c)
+    return 0;
+  if (n > 0)
+    {
+      pool = xcdbus_xmalloc (sizeof (connpool_t) + (n - 1) * sizeof (poolconn_t));
+      memset (pool, 0, sizeof (connpool_t));
+      pool->refs = 1;
+      for (i = 0; i < n; ++i)
+        {
+          DBusConnection *conn = dbus_bus_get_private (DBUS_BUS_SYSTEM, NULL);
+          if (!conn)
+            continue;
+          dbus_connection_set_exit_on_disconnect (conn, FALSE);
+          dbus_connection_add_filter (conn, pool_filter, NULL, NULL);
+          pool->v[opened].conn = conn;
+          pool->v[opened].inflight = 0;
+          ++opened;
+        }
+      pool->n = opened;
+      if (!opened)
+        {
+          xcdbus_xfree (pool);
+          pool = NULL;
+        }
+    }
+  connpool_publish (c, pool);
+  return opened;
+}
+
+/*
+ * Blocking calls in flight on each pooled connection, into inflight[0..max-1].
+ * Returns the number of pooled connections.
+ */
+EXTERNAL int
+xcdbus_get_connection_pool_inflight (xcdbus_conn_t * c, int *inflight, int max)
+{
+  connpool_t *pool;
+  int i, n;
+
+  c = xcdbus_of_conn (c);
+  if (!c || !(pool = connpool_get (c)))
+    return 0;
+  for (i = 0; i < pool->n && i < max; ++i)
+    inflight[i] = g_atomic_int_get (&pool->v[i].inflight);
+  n = pool->n;
+  connpool_unref (pool);
+  return n;
+}
+
+static int signals_flush (xcdbus_conn_t *c);
+
+EXTERNAL void
+xcdbus_shutdown (xcdbus_conn_t * c)
+{
+  int i;
+
+  if (!c)
+    return;
+
+  /* worker threads must be done with the connection by now */
+  if (c->io_thread)
+    {
+      g_atomic_int_set (&c->io_stop, 1);
+      xcdbus_ring_kick (c->outq);
+      g_thread_join (c->io_thread);
+      c->io_thread = NULL;
+    }
+
+  /* nothing batched is lost; after the I/O thread which runs timers */
+  timer_cancel (c, c->batch_timer);
+  c->batch_timer = NULL;
+  signals_flush (c);
+
+  if (c->backend != BACKEND_GLIB)
+    {
+      /* removes our watches through the callbacks while c is still alive */
+      dbus_connection_set_watch_functions (c->conn, NULL, NULL, NULL, NULL, NULL);
+      dbus_connection_set_timeout_functions (c->conn, NULL, NULL, NULL, NULL, NULL);
+      if (c->backend == BACKEND_EPOLL || c->backend == BACKEND_THREAD)
+        dbus_connection_set_dispatch_status_function (c->conn, NULL, NULL, NULL);
+    }
+  io_queues_free (c);
+  connpool_publish (c, NULL);
+  if (c->stats_path)
+    {
+      dbus_connection_unregister_object_path (c->conn, c->stats_path);
+      xcdbus_xfree (c->stats_path);
+    }
+  unregister_connection (c);
+  /* their free functions may still look at c */
+  g_hash_table_foreach (c->pending, pending_cancel, NULL);
+  g_hash_table_destroy (c->pending);
+  dbus_connection_remove_filter (c->conn, xcdbus_filter, c);
+  if (c->current_clear)
+    {
+      g_source_destroy (c->current_clear);
+      g_source_unref (c->current_clear);
+    }
+  current_message_set (c, NULL);
+  /* contexts still held by the application can no longer resolve domids */
+  xcdbus_registry_lock ();
+  while (c->msg_ctxs)
+    {
+      xcdbus_msg_ctx_t *ctx = (xcdbus_msg_ctx_t *) c->msg_ctxs->data;
+      ctx->c = NULL;
+      ctx->link = NULL;
+      c->msg_ctxs = g_list_delete_link (c->msg_ctxs, c->msg_ctxs);
+    }
+  xcdbus_registry_unlock ();
+  g_hash_table_foreach (c->owners, unwatch_name_owner, c);
+  xcdbus_registry_lock ();
+  g_hash_table_destroy (c->mirrors);
+  xcdbus_registry_unlock ();
+  xcdbus_dbcache_free (c->dbcache);
+  if (c->domids_match)
+    dbus_bus_remove_match (c->conn, DOMID_MATCH_RULE, NULL);
+  if (c->focus_tracking)
+    dbus_bus_remove_match (c->conn, FOCUS_MATCH_RULE, NULL);
+  if (c->vm_tracking)
+    dbus_bus_remove_match (c->conn, VM_STATE_MATCH_RULE, NULL);
+  g_hash_table_destroy (c->vm_domids);
+  g_hash_table_destroy (c->domids);
+  while (c->service_waits)
+    {
+      servicewait_t *w = (servicewait_t *) c->service_waits->data;
+      c->service_waits = g_list_delete_link (c->service_waits, c->service_waits);
+      timer_cancel (c, w->timer);
+      service_wait_free (w);
+    }
+  g_hash_table_destroy (c->owners);
+  xcdbus_registry_lock ();
+  g_hash_table_remove_all (c->proxies);
+  proxy_cache_publish (c);
+  xcdbus_registry_unlock ();
+  g_hash_table_destroy (c->proxies);
+  if (c->proxy_snap)
+    g_hash_table_destroy (c->proxy_snap);
+
+  for (i = 0; i < c->nwatches; ++i)
+    xcdbus_xfree (c->watches[i]);
+  if (c->watches)
+    xcdbus_xfree (c->watches);
+  if (c->epfd >= 0)
+    close (c->epfd);
+  if (c->evfd >= 0)
+    close (c->evfd);
+  if (c->tfd >= 0)
+    close (c->tfd);
+#ifdef HAVE_LIBEVENT
+  if (c->tev_added)
+    event_del (&c->tev);
+  if (c->backend == BACKEND_EVENT)
+    event_del (&c->dev);
+#endif
+  xcdbus_timerheap_free (&c->timers);
+
+  xcdbus_xfree (c);
+}
+
+/* ask the bus whether a name is owned, blocking */
+static int
+name_has_owner_query (xcdbus_conn_t * c, const char *service)
 {
   DBusMessage *msg, *reply;
   int has_owner = 0;
   DBusMessageIter args;
+
   msg = dbus_message_new_method_call ("org.freedesktop.DBus",
                                       "/org/freedesktop/DBus",
                                       "org.freedesktop.DBus", "NameHasOwner");
   if (!msg)
     return 0;
 
-  dbus_message_iter_init_append (msg, &args);
-  if (!dbus_message_iter_append_basic (&args, DBUS_TYPE_STRING, &service))
-    {
-      dbus_message_unref (msg);
-      return 0;
+  dbus_message_iter_init_append (msg, &args);
+  if (!dbus_message_iter_append_basic (&args, DBUS_TYPE_STRING, &service))
+    {
+      dbus_message_unref (msg);
+      return 0;
+    }
+  reply = call_blocking (c, msg);
+  if (!reply)
+    {
+      dbus_message_unref (msg);
+      return 0;
+    }
+  dbus_message_get_args (reply, NULL, DBUS_TYPE_BOOLEAN, &has_owner,
+                         DBUS_TYPE_INVALID);
+  dbus_message_unref (msg);
+  dbus_message_unref (reply);
+
+  return has_owner;
+}
+
+/* test if service of given name is published on dbus already */
+EXTERNAL int
+xcdbus_name_has_owner (xcdbus_conn_t * c, const char *service)
+{
+  xcdbus_conn_t *xc = xcdbus_of_conn (c);
+  int state = xc ? name_owner_state (xc, service) : OWNER_UNKNOWN;
+
+  /* tracked names are kept up to date by NameOwnerChanged */
+  if (state != OWNER_UNKNOWN)
+    return state == OWNER_SET;
+
+  return name_has_owner_query (c, service);
+}
+
+/*
+ * Keep the owner of a bus name in memory, following NameOwnerChanged, so
+ * xcdbus_name_has_owner answers without a round trip. Until the initial
+ * owner is known it still asks the bus.
+ */
+EXTERNAL void
+xcdbus_track_name_owner (xcdbus_conn_t * c, const char *service)
+{
+  c = xcdbus_of_conn (c);
+  if (c)
+    watch_name_owner (c, service);
+}
+
+/* wait until stuff appears on dbus */
+EXTERNAL void
+xcdbus_wait_service (xcdbus_conn_t * c, const char *service)
+{
+  xcdbus_wait_service_timeout (c, service, -1);
+}
+
+/*
+ * Wait at most timeout_ms (-1 for ever) for service to appear on dbus,
+ * returns 1 if it did. Wakes up on NameOwnerChanged; messages received
+ * meanwhile are dispatched, unless glib or the I/O thread of a threaded
+ * connection does that, in which case the bus is asked now and then.
+ */
+EXTERNAL int
+xcdbus_wait_service_timeout (xcdbus_conn_t * c, const char *service, int timeout_ms)
+{
+  int64_t deadline = timeout_ms >= 0 ? xcdbus_now_ms () + timeout_ms : -1;
+
+  c = xcdbus_of_conn (c);
+  if (!c)
+    return 0;
+  watch_name_owner (c, service);
+
+  for (;;)
+    {
+      int left = -1;
+
+      if (name_owner_state (c, service) == OWNER_SET)
+        return 1;
+      if (deadline >= 0)
+        {
+          int64_t l = deadline - xcdbus_now_ms ();
+          if (l <= 0)
+            return 0;
+          left = (int) l;
+        }
+
+      if (c->gloop || c->io_thread || c->dispatching)
+        {
+          /* our filter cannot run from here (glib or the I/O thread drives
+           * dispatching, or we are inside it), ask the bus now and then */
+          struct timeval tv = { 0 };
+          if (name_has_owner_query (c, service))
+            return 1;
+          if (left < 0 || left > WAIT_SERVICE_POLL)
+            left = WAIT_SERVICE_POLL;
+          tv.tv_sec = left / 1000;
+          tv.tv_usec = (left % 1000) * 1000;
+          select (0, NULL, NULL, NULL, &tv);
+          continue;
+        }
+
+      if (!dbus_connection_read_write (c->conn, left))
+        return 0;               /* disconnected */
+      xcdbus_dispatch (c);
     }
-  reply =
-    dbus_connection_send_with_reply_and_block (c->conn, msg, BLOCKING_TIMEOUT,
-                                               NULL);
-  if (!reply)
+}
+
+/*
+ * Call cb from the dispatch loop once service appears on dbus (online 1),
+ * or after timeout_ms (-1 for no limit) with online 0. If the service is
+ * known to be there already, cb runs before this returns.
+ */
+EXTERNAL void
+xcdbus_wait_service_async (xcdbus_conn_t * c, const char *service, int timeout_ms,
+                           xcdbus_service_cb cb, void *priv)
+{
+  servicewait_t *w;
+
+  c = xcdbus_of_conn (c);
+  if (!c || !cb)
+    return;
+  watch_name_owner (c, service);
+
+  if (name_owner_state (c, service) == OWNER_SET)
     {
-      dbus_message_unref (msg);
-      return 0;
+      cb (c, service, 1, priv);
+      return;
     }
-  dbus_message_get_args (reply, NULL, DBUS_TYPE_BOOLEAN, &has_owner,
-                         DBUS_TYPE_INVALID);
-  dbus_message_unref (msg);
-  dbus_message_unref (reply);
 
-  return has_owner;
+  w = g_new0 (servicewait_t, 1);
+  w->c = c;
+  w->name = g_strdup (service);
+  w->cb = cb;
+  w->priv = priv;
+  if (timeout_ms >= 0)
+    w->timer = timer_start (c, timeout_ms, service_wait_timeout, w);
+  c->service_waits = g_list_append (c->service_waits, w);
 }
 
-/* wait until stuff appears on dbus */
-EXTERNAL void
-xcdbus_wait_service (xcdbus_conn_t * c, const char *service)
+/* send the signals batched so far and flush, 0 if any could not be queued */
+static int
+signals_flush (xcdbus_conn_t *c)
 {
-  /* FIXME: add timeout + logs */
-  while (!xcdbus_name_has_owner (c, service))
-    {
-      struct timeval tv = { 0 };
-      tv.tv_sec = 1;
-      select (0, NULL, NULL, NULL, &tv);
+    GQueue q;
+    DBusMessage *msg;
+    int ok = 1;
+
+    xcdbus_registry_lock();
+    q = c->batched;
+    g_queue_init(&c->batched);
+    xcdbus_registry_unlock();
+    while ((msg = g_queue_pop_head(&q))) {
+        if (!dbus_connection_send(c->conn, msg, NULL)) {
+            ok = 0;
+        }
+        dbus_message_unref(msg);
+    }
+    dbus_connection_flush(c->conn);
+    return ok;
+}
+
+static void
+signals_flush_timer (void *data)
+{
+    xcdbus_conn_t *c = (xcdbus_conn_t *) data;
+
+    /* the timer frees itself */
+    xcdbus_registry_lock();
+    c->batch_timer = NULL;
+    xcdbus_registry_unlock();
+    signals_flush(c);
+}
+
+/* send or batch msg, takes over its reference */
+static int
+send_signal (xcdbus_conn_t *c, DBusMessage *msg)
+{
+    if (c->signal_batching) {
+        xcdbus_registry_lock();
+        g_queue_push_tail(&c->batched, msg);
+        if (!c->batch_timer) {
+            /* fires on the next loop iteration */
+            c->batch_timer = timer_start(c, 0, signals_flush_timer, c);
+        }
+        xcdbus_registry_unlock();
+        return 1;
+    }
+    if (!dbus_connection_send(c->conn, msg, NULL)) {
+        dbus_message_unref(msg);
+        return 0;
     }
+    dbus_connection_flush(c->conn);
+    dbus_message_unref(msg);
+    return 1;
 }
 
 /* send a simple signal with one string parameter attached if data != NULL */
@@ -450,44 +2688,279 @@ EXTERNAL int xcdbus_broadcast_signal (
             return 0;
         }
     }
-    if (!dbus_connection_send(c->conn, msg, NULL)) {
+    return send_signal(c, msg);
+}
+
+/*
+ * send a signal with arguments given as for dbus_message_append_args,
+ * terminated by DBUS_TYPE_INVALID
+ */
+EXTERNAL int xcdbus_broadcast_signal_args (
+    xcdbus_conn_t *c,
+    const char *object_path,
+    const char *interface,
+    const char *member,
+    int first_arg_type,
+    ...)
+{
+    DBusMessage *msg;
+    va_list args;
+    int ok;
+
+    msg = dbus_message_new_signal(object_path, interface, member);
+    if (!msg) {
+        return 0;
+    }
+    va_start(args, first_arg_type);
+    ok = dbus_message_append_args_valist(msg, first_arg_type, args);
+    va_end(args);
+    if (!ok) {
         dbus_message_unref(msg);
         return 0;
     }
-    dbus_connection_flush(c->conn);
-    dbus_message_unref(msg);
-    return 1;
+    return send_signal(c, msg);
+}
+
+/*
+ * In batch mode signals are held back and sent together, with a single
+ * flush, on the next iteration of the loop driving the connection or at
+ * xcdbus_flush. Turning it off sends what is held back.
+ */
+EXTERNAL void
+xcdbus_set_signal_batching (xcdbus_conn_t *c, int enable)
+{
+    c = xcdbus_of_conn(c);
+    if (!c) {
+        return;
+    }
+    c->signal_batching = enable;
+    if (!enable) {
+        signals_flush(c);
+    }
+}
+
+/* send batched signals, and block until everything queued is written */
+EXTERNAL void
+xcdbus_flush (xcdbus_conn_t *c)
+{
+    c = xcdbus_of_conn(c);
+    if (!c) {
+        return;
+    }
+    /* also flushes when nothing was batched */
+    signals_flush(c);
+}
+
+/*
+ * bytes queued for sending and not written yet; signals held back in batch
+ * mode are not marshalled yet, see xcdbus_get_batched_signals
+ */
+EXTERNAL long
+xcdbus_get_outgoing_size (xcdbus_conn_t *c)
+{
+    c = xcdbus_of_conn(c);
+    if (!c) {
+        return 0;
+    }
+    return dbus_connection_get_outgoing_size(c->conn);
 }
 
+/* number of signals held back in batch mode */
+EXTERNAL int
+xcdbus_get_batched_signals (xcdbus_conn_t *c)
+{
+    int n;
+
+    c = xcdbus_of_conn(c);
+    if (!c) {
+        return 0;
+    }
+    xcdbus_registry_lock();
+    n = c->batched.length;
+    xcdbus_registry_unlock();
+    return n;
+}
+
+/* sender of the message being handled, "" if none */
 EXTERNAL const char*
 xcdbus_get_sender (xcdbus_conn_t *xc)
 {
-    return xc->sender;
+    const char *sender = xc->current ? dbus_message_get_sender (xc->current) : NULL;
+    return sender ? sender : "";
 }
 
-EXTERNAL int32_t
-xcdbus_get_sender_domid (xcdbus_conn_t *xc)
+static DBusMessage *
+domid_query_new (const char *sender)
+{
+    DBusMessage *msg = dbus_message_new_method_call( "org.freedesktop.DBus",
+                                                     "/org/freedesktop/DBus",
+                                                     "org.freedesktop.DBus",
+                                                     "GetConnectionDOMID" );
+    if (!msg)
+        return NULL;
+    if (!dbus_message_append_args (msg, DBUS_TYPE_STRING, &sender, DBUS_TYPE_INVALID)) {
+        dbus_message_unref (msg);
+        return NULL;
+    }
+    return msg;
+}
+
+static int32_t
+domid_of_reply (DBusMessage *reply)
 {
-    DBusMessage *msg, *reply;
-    DBusMessageIter args;
     int32_t domid = -1;
-    const char *sender = xc->sender;
-    if (sender[0] == 0)
+    if (!reply || dbus_message_get_type (reply) != DBUS_MESSAGE_TYPE_METHOD_RETURN)
         return -1;
+    if (!dbus_message_get_args (reply, NULL, DBUS_TYPE_INT32, &domid, DBUS_TYPE_INVALID))
+        return -1;
+    return domid;
+}
 
-    msg = dbus_message_new_method_call( "org.freedesktop.DBus",
-                                        "/org/freedesktop/DBus",
-                                        "org.freedesktop.DBus",
-                                        "GetConnectionDOMID" );
+/* entries are only trusted while we hear about their names going away */
+static void
+domid_cache_init (xcdbus_conn_t *xc)
+{
+    int first;
+
+    xcdbus_registry_lock ();
+    first = !xc->domids_match;
+    xc->domids_match = 1;
+    xcdbus_registry_unlock ();
+    if (first)
+        dbus_bus_add_match (xc->conn, DOMID_MATCH_RULE, NULL);
+}
+
+/* the domid cache is read from any thread, so it is used under the lock */
+static void
+domid_query_notify (DBusPendingCall *pending, void *data)
+{
+    namequery_t *q = (namequery_t *) data;
+    DBusMessage *reply = dbus_pending_call_steal_reply (pending);
+    int32_t domid = domid_of_reply (reply);
+    senderdomid_t *d;
+
+    xcdbus_registry_lock ();
+    /* it may have left the bus, or been looked up by a blocking call */
+    d = g_hash_table_lookup (q->c->domids, q->name);
+    if (d && d->querying) {
+        if (domid >= 0) {
+            d->domid = domid;
+            d->querying = 0;
+            if (d->pending)
+                dbus_pending_call_unref (d->pending);
+            d->pending = NULL;
+        } else {
+            g_hash_table_remove (q->c->domids, q->name);
+        }
+    }
+    xcdbus_registry_unlock ();
+
+    if (reply)
+        dbus_message_unref (reply);
+    pending_done (q->c, pending);
+}
+
+/* start resolving the domid of sender unless known or on its way */
+static void
+domid_prefetch (xcdbus_conn_t *xc, const char *sender)
+{
+    DBusMessage *msg;
+    DBusPendingCall *pending = NULL;
+    namequery_t *q;
+    senderdomid_t *d;
+    int sent = 0;
+
+    xcdbus_registry_lock ();
+    if (g_hash_table_lookup (xc->domids, sender)) {
+        xcdbus_registry_unlock ();
+        return;
+    }
+    /* in before the query, so its reply finds it */
+    d = g_new0 (senderdomid_t, 1);
+    d->domid = -1;
+    d->querying = 1;
+    g_hash_table_insert (xc->domids, g_strdup (sender), d);
+    xcdbus_registry_unlock ();
+
+    msg = domid_query_new (sender);
+    if (msg) {
+        q = g_new0 (namequery_t, 1);
+        q->c = xc;
+        q->name = g_strdup (sender);
+        sent = send_async (xc, msg, domid_query_notify, q, name_query_free, &pending);
+        dbus_message_unref (msg);
+    }
+
+    xcdbus_registry_lock ();
+    d = g_hash_table_lookup (xc->domids, sender);
+    if (d && d->querying) {
+        if (!sent) {
+            g_hash_table_remove (xc->domids, sender);
+        } else if (!d->pending) {
+            /* for sender_domid to wait on */
+            d->pending = pending;
+            pending = NULL;
+        }
+    }
+    xcdbus_registry_unlock ();
+    if (pending)
+        dbus_pending_call_unref (pending);
+}
+
+static int32_t
+sender_domid (xcdbus_conn_t *xc, const char *sender)
+{
+    DBusMessage *msg = NULL, *reply = NULL;
+    DBusPendingCall *pending = NULL;
+    int32_t domid = -1;
+    senderdomid_t *d;
+    int known = 0;
+
+    if (!sender || sender[0] == 0)
+        return -1;
+
+    domid_cache_init (xc);
+    xcdbus_registry_lock ();
+    d = g_hash_table_lookup (xc->domids, sender);
+    if (d && !d->querying) {
+        known = 1;
+        domid = d->domid;
+    } else if (d && d->pending) {
+        pending = dbus_pending_call_ref (d->pending);
+    }
+    xcdbus_registry_unlock ();
+    if (known)
+        return domid;
+
+    if (pending) {
+        /* completes through domid_query_notify */
+        dbus_pending_call_block (pending);
+        dbus_pending_call_unref (pending);
+        xcdbus_registry_lock ();
+        d = g_hash_table_lookup (xc->domids, sender);
+        if (d && !d->querying) {
+            known = 1;
+            domid = d->domid;
+        }
+        xcdbus_registry_unlock ();
+        if (known)
+            return domid;
+    }
+
+    msg = domid_query_new (sender);
     if (!msg)
         goto error;
-    dbus_message_iter_init_append (msg, &args);
-    if (!dbus_message_iter_append_basic (&args, DBUS_TYPE_STRING, &sender))
-        goto error;
-    reply = dbus_connection_send_with_reply_and_block(xc->conn, msg, BLOCKING_TIMEOUT, NULL);
+    reply = call_blocking (xc, msg);
     if (!reply)
         goto error;
-    dbus_message_get_args(reply, NULL, DBUS_TYPE_INT32, &domid, DBUS_TYPE_INVALID);
+    domid = domid_of_reply (reply);
+    if (domid >= 0) {
+        d = g_new0 (senderdomid_t, 1);
+        d->domid = domid;
+        xcdbus_registry_lock ();
+        g_hash_table_replace (xc->domids, g_strdup (sender), d);
+        xcdbus_registry_unlock ();
+    }
 
     dbus_message_unref(msg);
     dbus_message_unref(reply);
@@ -499,6 +2972,105 @@ error:
     return -1;
 }
 
+EXTERNAL int32_t
+xcdbus_get_sender_domid (xcdbus_conn_t *xc)
+{
+    return sender_domid (xc, xcdbus_get_sender (xc));
+}
+
+/*
+ * Context of the message whose handler is running: its sender, serial and
+ * the sender's domid, resolved on first use. Unlike xcdbus_get_sender it
+ * stays valid after the handler returns, so it can be kept for a deferred
+ * reply. Returns a reference to release with xcdbus_msg_ctx_unref, or NULL
+ * outside of a handler.
+ */
+EXTERNAL xcdbus_msg_ctx_t *
+xcdbus_get_msg_ctx (xcdbus_conn_t *xc)
+{
+    xcdbus_msg_ctx_t *ctx;
+    const char *sender;
+
+    xc = xcdbus_of_conn (xc);
+    if (!xc || !xc->current)
+        return NULL;
+    if (!xc->current_ctx) {
+        sender = dbus_message_get_sender (xc->current);
+        ctx = g_new0 (xcdbus_msg_ctx_t, 1);
+        ctx->refs = 1;
+        ctx->c = xc;
+        ctx->sender = g_strdup (sender ? sender : "");
+        ctx->serial = dbus_message_get_serial (xc->current);
+        ctx->domid = -2;
+        xcdbus_registry_lock ();
+        xc->msg_ctxs = g_list_prepend (xc->msg_ctxs, ctx);
+        ctx->link = xc->msg_ctxs;
+        xcdbus_registry_unlock ();
+        xc->current_ctx = ctx;
+    }
+    return xcdbus_msg_ctx_ref (xc->current_ctx);
+}
+
+EXTERNAL xcdbus_msg_ctx_t *
+xcdbus_msg_ctx_ref (xcdbus_msg_ctx_t *ctx)
+{
+    g_atomic_int_inc (&ctx->refs);
+    return ctx;
+}
+
+/* from any thread, contexts are kept across async work */
+EXTERNAL void
+xcdbus_msg_ctx_unref (xcdbus_msg_ctx_t *ctx)
+{
+    if (!ctx || !g_atomic_int_dec_and_test (&ctx->refs))
+        return;
+    xcdbus_registry_lock ();
+    if (ctx->c)
+        ctx->c->msg_ctxs = g_list_delete_link (ctx->c->msg_ctxs, ctx->link);
+    xcdbus_registry_unlock ();
+    g_free (ctx->sender);
+    g_free (ctx);
+}
+
+EXTERNAL const char *
+xcdbus_msg_ctx_sender (xcdbus_msg_ctx_t *ctx)
+{
+    return ctx->sender;
+}
+
+EXTERNAL dbus_uint32_t
+xcdbus_msg_ctx_serial (xcdbus_msg_ctx_t *ctx)
+{
+    return ctx->serial;
+}
+
+/* -1 if it cannot be found, may block the first time unless prefetched */
+EXTERNAL int32_t
+xcdbus_msg_ctx_domid (xcdbus_msg_ctx_t *ctx)
+{
+    if (ctx->domid == -2) {
+        if (!ctx->c)
+            return -1;
+        ctx->domid = sender_domid (ctx->c, ctx->sender);
+    }
+    return ctx->domid;
+}
+
+/*
+ * Start resolving the domid of each new method caller as soon as
+ * xcdbus_filter sees its message, so xcdbus_get_sender_domid rarely waits
+ */
+EXTERNAL void
+xcdbus_set_domid_prefetch (xcdbus_conn_t *xc, int enable)
+{
+    xc = xcdbus_of_conn (xc);
+    if (!xc)
+        return;
+    if (enable)
+        domid_cache_init (xc);
+    xc->domids_prefetch = enable;
+}
+
 EXTERNAL void
 xcdbus_set_error(GError** err, const char* interface, const char* error, const char *fmt, ...)
 {
@@ -522,10 +3094,41 @@ xcdbus_set_error(GError** err, const char* interface, const char* error, const c
    dbus_set_g_error(err, &e);
 }
 
+/* have the backend come back soon for messages a budget left queued */
+static void
+dispatch_wakeup (xcdbus_conn_t *xc)
+{
+    switch (xc->backend) {
+#ifdef HAVE_LIBEVENT
+    case BACKEND_EVENT: {
+        struct timeval tv = { 0, 0 };
+        event_add(&xc->dev, &tv);
+        break;
+    }
+#endif
+#ifdef HAVE_SYS_EPOLL_H
+    case BACKEND_EPOLL:
+        eventfd_write(xc->evfd, 1);
+        break;
+#endif
+    default:
+        /* xcdbus_pre_poll and xcdbus_next_timeout return 0 on queued data */
+        break;
+    }
+}
+
+/*
+ * dispatch at most max_messages messages (0 for no limit) and for at most
+ * about max_us microseconds (0 for no limit). Returns 1 if messages are
+ * left in the queue, in which case the event backend is woken up again.
+ */
 EXTERNAL int
-xcdbus_dispatch (xcdbus_conn_t *xc)
+xcdbus_dispatch_budget (xcdbus_conn_t *xc, unsigned int max_messages, unsigned int max_us)
 {
-    DBusMessage *m  = NULL;
+    int64_t start, elapsed;
+    unsigned long n = 0;
+    int remains = 0;
+
     if (!xc) {
         return 0;
     }
@@ -540,27 +3143,141 @@ xcdbus_dispatch (xcdbus_conn_t *xc)
         return 0;
     }
     xc->dispatching = 1;
+    if (xcdbus_thread_safe()) {
+        xc->dispatch_thread = g_thread_self();
+    }
+    start = xcdbus_now_us();
 
     for (;;) {
-        const char *sender;
-        m = dbus_connection_borrow_message(xc->conn);
-        if (!m)
+        if (dbus_connection_get_dispatch_status(xc->conn) != DBUS_DISPATCH_DATA_REMAINS)
+            break;
+        if ((max_messages && n >= max_messages) ||
+            (max_us && xcdbus_now_us() - start >= max_us))
+        {
+            remains = 1;
             break;
-        sender = dbus_message_get_sender(m);
-        if (!sender) {
-            xc->sender[0] = 0;
-        } else {
-            strncpy(xc->sender, sender, sizeof(xc->sender));
         }
-        dbus_connection_return_message(xc->conn, m);
         /* dispatches at most 1 message according to dbus doc */
         dbus_connection_dispatch(xc->conn);
+        /* its handlers are done, and pending call notifies see no message */
+        current_message_set(xc, NULL);
+        ++n;
+    }
+    xc->dispatching = 0;
+
+    elapsed = xcdbus_now_us() - start;
+    xc->dstats.calls++;
+    xc->dstats.messages += n;
+    xc->dstats.total_us += elapsed;
+    if (n > xc->dstats.max_messages)
+        xc->dstats.max_messages = n;
+    if (elapsed > xc->dstats.max_us)
+        xc->dstats.max_us = elapsed;
+    if (n)
+        xcdbus_stats_record("", "dispatch", elapsed, XCDBUS_STATS_OK, 0, 0);
+    if (remains) {
+        xc->dstats.budget_hits++;
+        dispatch_wakeup(xc);
+    }
+    return remains;
+}
+
+/*
+ * dispatch queued messages, within the budget set by
+ * xcdbus_set_dispatch_budget. Returns 1 if messages are left.
+ */
+EXTERNAL int
+xcdbus_dispatch (xcdbus_conn_t *xc)
+{
+    xcdbus_conn_t *c = xcdbus_of_conn(xc);
+    if (!c) {
+        return 0;
+    }
+    return xcdbus_dispatch_budget(c, c->budget_messages, c->budget_us);
+}
+
+/*
+ * Bound the work done by each dispatch the library runs from its event
+ * backends, so a flood on this connection cannot starve the caller's other
+ * fds and timers. 0 means no limit.
+ */
+EXTERNAL void
+xcdbus_set_dispatch_budget (xcdbus_conn_t *xc, unsigned int max_messages, unsigned int max_us)
+{
+    xc = xcdbus_of_conn(xc);
+    if (!xc) {
+        return;
+    }
+    xc->budget_messages = max_messages;
+    xc->budget_us = max_us;
+}
+
+EXTERNAL void
+xcdbus_get_dispatch_stats (xcdbus_conn_t *xc, xcdbus_dispatch_stats_t *stats)
+{
+    xc = xcdbus_of_conn(xc);
+    if (!xc) {
+        memset(stats, 0, sizeof(*stats));
+        return;
+    }
+    *stats = xc->dstats;
+}
+
+EXTERNAL void
+xcdbus_reset_dispatch_stats (xcdbus_conn_t *xc)
+{
+    xc = xcdbus_of_conn(xc);
+    if (xc) {
+        memset(&xc->dstats, 0, sizeof(xc->dstats));
+    }
+}
+
+/*
+ * Watch for blocking calls of the library which hold up the dispatch loop:
+ * those made from a callback xcdbus_dispatch is running, and with stall_ms
+ * non-zero any taking that long. cb (can be NULL) is told about each, from
+ * the thread which made the call, and they count as stalls in
+ * xcdbus_get_stats. A NULL cb with stall_ms 0 turns the watch off again.
+ */
+EXTERNAL void
+xcdbus_set_stall_watch (xcdbus_conn_t *xc, unsigned int stall_ms, xcdbus_stall_cb cb, void *priv)
+{
+    xc = xcdbus_of_conn(xc);
+    if (!xc) {
+        return;
+    }
+    xc->stall_ms = stall_ms;
+    xc->stall_cb = cb;
+    xc->stall_priv = priv;
+    xc->stall_watch = cb || stall_ms;
+}
+
+/*
+ * Serve xcdbus_get_stats read-only at objpath, as method get of interface
+ * com.citrix.xenclient.xcdbus.stats, and turn counting on. One object per
+ * connection. Returns 0 on failure.
+ */
+EXTERNAL int
+xcdbus_export_stats (xcdbus_conn_t *xc, const char *objpath)
+{
+    static const DBusObjectPathVTable vtable = { NULL, xcdbus_stats_object_message };
+
+    xc = xcdbus_of_conn(xc);
+    if (!xc || xc->stats_path) {
+        return 0;
+    }
+    if (!dbus_connection_register_object_path(xc->conn, objpath, &vtable, xc)) {
+        return 0;
     }
-    xc->dispatching = 0;
-    return 0;
+    xc->stats_path = strdup(objpath);
+    xcdbus_enable_stats(1);
+    return 1;
 }
 
-/* call before waiting on select(), returns modified number of file descriptors */
+/*
+ * call before waiting on select(), returns modified number of file descriptors.
+ * The select timeout should not exceed xcdbus_next_timeout().
+ */
 EXTERNAL int
 xcdbus_pre_select (xcdbus_conn_t * c, int nfds, fd_set * readfds,
                    fd_set * writefds, fd_set * exceptfds)
@@ -572,7 +3289,7 @@ xcdbus_pre_select (xcdbus_conn_t * c, int nfds, fd_set * readfds,
 
   for (i = 0; i < c->nwatches; ++i)
     {
-      xcdbus_watch_t *w = &c->watches[i];
+      xcdbus_watch_t *w = c->watches[i];
       if (!w->cond)
         continue;
 
@@ -602,7 +3319,7 @@ xcdbus_post_select (xcdbus_conn_t * c, int nfds, fd_set * readfds,
   int i;
   for (i = 0; i < c->nwatches; ++i)
     {
-      xcdbus_watch_t *w = &c->watches[i];
+      xcdbus_watch_t *w = c->watches[i];
       if (!w->cond)
         continue;
 
@@ -623,8 +3340,118 @@ xcdbus_post_select (xcdbus_conn_t * c, int nfds, fd_set * readfds,
         }
 
       if (watch_flags)
-        watch_process (c, w->dbw, watch_flags);
+        watch_process (c, w, watch_flags);
+    }
+
+  timers_process (c);
+}
+
+/*
+ * ms until the next libdbus timeout is due and xcdbus_post_select or
+ * xcdbus_post_poll need to run, -1 if none is armed; 0 while messages
+ * wait to be dispatched
+ */
+EXTERNAL int
+xcdbus_next_timeout (xcdbus_conn_t * c)
+{
+  xcdbus_timeout_t *t;
+  int64_t deadline;
+
+  /* a dispatch budget left messages queued */
+  if (dbus_connection_get_dispatch_status (c->conn) == DBUS_DISPATCH_DATA_REMAINS)
+    return 0;
+  xcdbus_loop_lock ();
+  t = xcdbus_timerheap_top (&c->timers);
+  deadline = t ? t->deadline : -1;
+  xcdbus_loop_unlock ();
+  if (deadline < 0)
+    return -1;
+  deadline -= xcdbus_now_ms ();
+  return deadline > 0 ? (int) deadline : 0;
+}
+
+/*
+ * call before poll(), fills the first entries of fds with the connection's
+ * watches and returns how many were used, or -1 if nfds is too small.
+ * *timeout, if given, is lowered to the number of ms until xcdbus_post_poll
+ * needs to be called again (-1 stands for no deadline).
+ */
+EXTERNAL int
+xcdbus_pre_poll (xcdbus_conn_t * c, struct pollfd * fds, int nfds, int *timeout)
+{
+  int i, n = 0;
+
+  /* dispatch remaining data */
+  xcdbus_dispatch(c);
+
+  xcdbus_loop_lock ();
+  for (i = 0; i < c->nwatches; ++i)
+    {
+      xcdbus_watch_t *w = c->watches[i];
+      if (!w->cond)
+        continue;
+
+      if (n == nfds)
+        {
+          xcdbus_loop_unlock ();
+          return -1;
+        }
+
+      fds[n].fd = w->fd;
+      fds[n].events = 0;
+      fds[n].revents = 0;
+      if (w->cond & XCDBUS_FD_COND_READ)
+        fds[n].events |= POLLIN;
+      if (w->cond & XCDBUS_FD_COND_WRITE)
+        fds[n].events |= POLLOUT;
+      ++n;
+    }
+  xcdbus_loop_unlock ();
+
+  if (timeout)
+    {
+      /* 0 if a budget or recursive dispatch left messages behind */
+      int next = xcdbus_next_timeout (c);
+      if (next >= 0 && (*timeout < 0 || next < *timeout))
+        *timeout = next;
+    }
+
+  return n;
+}
+
+/* call after poll() with the entries filled by xcdbus_pre_poll */
+EXTERNAL void
+xcdbus_post_poll (xcdbus_conn_t * c, struct pollfd * fds, int nfds)
+{
+  int i;
+  for (i = 0; i < nfds; ++i)
+    {
+      xcdbus_watch_t *w;
+      int watch_flags = 0;
+
+      if (!fds[i].revents)
+        continue;
+      /* entries are never freed before shutdown */
+      xcdbus_loop_lock ();
+      w = find_watch_by_fd (c, fds[i].fd, 0);
+      xcdbus_loop_unlock ();
+      if (!w || !w->cond)
+        continue;
+
+      if (fds[i].revents & POLLIN)
+        watch_flags |= DBUS_WATCH_READABLE;
+      if (fds[i].revents & POLLOUT)
+        watch_flags |= DBUS_WATCH_WRITABLE;
+      if (fds[i].revents & POLLERR)
+        watch_flags |= DBUS_WATCH_ERROR;
+      if (fds[i].revents & POLLHUP)
+        watch_flags |= DBUS_WATCH_HANGUP;
+
+      if (watch_flags)
+        watch_process (c, w, watch_flags);
     }
+
+  timers_process (c);
 }
 
 /*
@@ -633,9 +3460,108 @@ xcdbus_post_select (xcdbus_conn_t * c, int nfds, fd_set * readfds,
 EXTERNAL int
 xcdbus_db_daemon_online(xcdbus_conn_t *conn)
 {
+    xcdbus_track_name_owner(conn, DB_SERVICE);
     return xcdbus_name_has_owner(conn, DB_SERVICE);
 }
 
+/* db read through call_blocking, the value strdup'd or NULL on RPC error */
+static char *
+db_read_blocking(xcdbus_conn_t *c, const char *path)
+{
+    DBusMessage *msg, *reply;
+    const char *value = NULL;
+    char *r = NULL;
+
+    msg = dbus_message_new_method_call(DB_SERVICE, "/", DB_INTERFACE, "read");
+    if (!msg) {
+        return NULL;
+    }
+    if (dbus_message_append_args(msg, DBUS_TYPE_STRING, &path, DBUS_TYPE_INVALID) &&
+        (reply = call_blocking(c, msg))) {
+        if (dbus_message_get_args(reply, NULL, DBUS_TYPE_STRING, &value, DBUS_TYPE_INVALID)) {
+            r = strdup(value);
+        }
+        dbus_message_unref(reply);
+    }
+    dbus_message_unref(msg);
+    return r;
+}
+
+static int
+db_write_blocking(xcdbus_conn_t *c, const char *path, const char *value)
+{
+    DBusMessage *msg, *reply = NULL;
+
+    msg = dbus_message_new_method_call(DB_SERVICE, "/", DB_INTERFACE, "write");
+    if (!msg) {
+        return FALSE;
+    }
+    if (dbus_message_append_args(msg, DBUS_TYPE_STRING, &path, DBUS_TYPE_STRING, &value,
+                                 DBUS_TYPE_INVALID)) {
+        reply = call_blocking(c, msg);
+    }
+    dbus_message_unref(msg);
+    if (!reply) {
+        return FALSE;
+    }
+    dbus_message_unref(reply);
+    return TRUE;
+}
+
+/*
+ * the db cache is used by readers on any thread and filled from dispatch,
+ * so it is only touched under the lock
+ */
+
+/* malloc'd copy of the cached value of path, NULL on miss */
+static char *
+db_cache_lookup(xcdbus_conn_t *c, const char *path)
+{
+    const char *cached;
+    char *value = NULL;
+
+    xcdbus_registry_lock();
+    if (c->dbcache && (cached = xcdbus_dbcache_lookup(c->dbcache, path))) {
+        value = strdup(cached);
+    }
+    xcdbus_registry_unlock();
+    return value;
+}
+
+static unsigned long
+db_cache_generation(xcdbus_conn_t *c)
+{
+    unsigned long generation;
+
+    xcdbus_registry_lock();
+    generation = c->db_generation;
+    xcdbus_registry_unlock();
+    return generation;
+}
+
+/* forget path and what is below it, everything if NULL */
+static void
+db_cache_invalidate(xcdbus_conn_t *c, const char *path)
+{
+    xcdbus_registry_lock();
+    c->db_generation++;
+    if (c->dbcache) {
+        xcdbus_dbcache_invalidate(c->dbcache, path);
+    }
+    xcdbus_registry_unlock();
+}
+
+/* cache what a read sent at generation returned, unless it may be stale */
+static void
+db_cache_fill(xcdbus_conn_t *c, const char *path, const char *value, unsigned long generation)
+{
+    xcdbus_registry_lock();
+    if (c->dbcache && c->db_generation == generation) {
+        xcdbus_dbcache_store(c->dbcache, path, value);
+    }
+    xcdbus_registry_unlock();
+}
+
 /*
  * Read value from config database. Returns 0 on RPC error.
  * Returns 1 otherwise. If database node does not exist, returns 1
@@ -644,15 +3570,48 @@ xcdbus_db_daemon_online(xcdbus_conn_t *conn)
 EXTERNAL int
 xcdbus_read_db(xcdbus_conn_t *c, const char *path, char *buf, int buf_size)
 {
+    xcdbus_conn_t *xc = xcdbus_of_conn(c);
     char *value = NULL;
-    if (!com_citrix_xenclient_db_read_(c, DB_SERVICE, "/", path, &value)) {
-        return FALSE;
+    unsigned long generation = xc ? db_cache_generation(xc) : 0;
+
+    if (xc && xc->dbcache && (value = db_cache_lookup(xc, path))) {
+        strncpy(buf, value, buf_size);
+        free(value);
+        return TRUE;
+    }
+    if (xc && g_atomic_pointer_get(&xc->pool)) {
+        if (!(value = db_read_blocking(xc, path))) {
+            return FALSE;
+        }
+    } else {
+        int64_t start = xcdbus_now_us();
+        int ok = com_citrix_xenclient_db_read_(c, DB_SERVICE, "/", path, &value);
+        stats_gcall(xc, DB_SERVICE, "read", ok, NULL, start);
+        if (!ok) {
+            return FALSE;
+        }
+    }
+    if (xc) {
+        db_cache_fill(xc, path, value, generation);
     }
     strncpy(buf, value, buf_size);
     free(value);
     return TRUE;
 }
 
+/* write-through: the node now holds value, whatever was below it is gone */
+static void
+db_cache_written(xcdbus_conn_t *c, const char *path, const char *value)
+{
+    xcdbus_registry_lock();
+    c->db_generation++;
+    if (c->dbcache) {
+        xcdbus_dbcache_invalidate(c->dbcache, path);
+        xcdbus_dbcache_store(c->dbcache, path, value);
+    }
+    xcdbus_registry_unlock();
+}
+
 /*
  * Write value to database. Returns 0 on RPC fail. Node is created if it
  * doesn't exist already
@@ -660,32 +3619,425 @@ xcdbus_read_db(xcdbus_conn_t *c, const char *path, char *buf, int buf_size)
 EXTERNAL int
 xcdbus_write_db(xcdbus_conn_t *c, const char *path, const char *value)
 {
-    if (!com_citrix_xenclient_db_write_(c, DB_SERVICE, "/", path, value)) {
+    xcdbus_conn_t *xc = xcdbus_of_conn(c);
+
+    int ok;
+
+    if (xc && g_atomic_pointer_get(&xc->pool)) {
+        ok = db_write_blocking(xc, path, value);
+    } else {
+        int64_t start = xcdbus_now_us();
+        ok = com_citrix_xenclient_db_write_(c, DB_SERVICE, "/", path, value);
+        stats_gcall(xc, DB_SERVICE, "write", ok, NULL, start);
+    }
+    if (!ok) {
+        /* unknown what the database holds now */
+        if (xc) {
+            db_cache_invalidate(xc, path);
+        }
+        return FALSE;
+    }
+    if (xc) {
+        db_cache_written(xc, path, value);
+    }
+    return TRUE;
+}
+
+typedef struct dbrequest {
+    xcdbus_conn_t *c;
+    char *path;
+    /* written value, for the cache */
+    char *value;
+    /* db_generation when a read was sent */
+    unsigned long generation;
+    xcdbus_db_read_cb read_cb;
+    xcdbus_db_write_cb write_cb;
+    void *priv;
+} dbrequest_t;
+
+static void
+db_request_free(void *data)
+{
+    dbrequest_t *r = (dbrequest_t *) data;
+    r->c->db_inflight--;
+    xcdbus_xfree(r->path);
+    xcdbus_xfree(r->value);
+    xcdbus_xfree(r);
+}
+
+static void
+db_read_notify(DBusPendingCall *pending, void *data)
+{
+    dbrequest_t *r = (dbrequest_t *) data;
+    DBusMessage *reply = dbus_pending_call_steal_reply(pending);
+    const char *value = NULL;
+
+    if (reply && dbus_message_get_type(reply) == DBUS_MESSAGE_TYPE_METHOD_RETURN) {
+        if (!dbus_message_get_args(reply, NULL, DBUS_TYPE_STRING, &value, DBUS_TYPE_INVALID)) {
+            value = NULL;
+        }
+    }
+    if (value) {
+        db_cache_fill(r->c, r->path, value, r->generation);
+    }
+    r->read_cb(r->c, r->path, value, r->priv);
+
+    if (reply) dbus_message_unref(reply);
+    pending_done(r->c, pending);
+}
+
+static void
+db_write_notify(DBusPendingCall *pending, void *data)
+{
+    dbrequest_t *r = (dbrequest_t *) data;
+    DBusMessage *reply = dbus_pending_call_steal_reply(pending);
+    int ok = reply && dbus_message_get_type(reply) == DBUS_MESSAGE_TYPE_METHOD_RETURN;
+
+    if (ok) {
+        db_cache_written(r->c, r->path, r->value);
+    } else {
+        db_cache_invalidate(r->c, r->path);
+    }
+    if (r->write_cb) {
+        r->write_cb(r->c, r->path, ok, r->priv);
+    }
+
+    if (reply) dbus_message_unref(reply);
+    pending_done(r->c, pending);
+}
+
+/* queue a db method call, the reply is handed to notify from dispatch */
+static int
+db_send_async(xcdbus_conn_t *c, DBusMessage *msg, DBusPendingCallNotifyFunction notify, dbrequest_t *r)
+{
+    c->db_inflight++;
+    if (!send_async(c, msg, notify, r, db_request_free, NULL)) {
+        dbus_message_unref(msg);
         return FALSE;
     }
+    dbus_message_unref(msg);
     return TRUE;
 }
 
+/*
+ * Start reading a value from config database. Returns 0 if the request
+ * could not be sent, in which case cb is never called. Otherwise cb gets
+ * the value from the dispatch loop, or NULL on RPC error; the value is only
+ * valid during the callback. Any number of requests can be in flight.
+ */
+EXTERNAL int
+xcdbus_read_db_async(xcdbus_conn_t *c, const char *path, xcdbus_db_read_cb cb, void *priv)
+{
+    DBusMessage *msg;
+    dbrequest_t *r;
+
+    c = xcdbus_of_conn(c);
+    if (!c || !cb) {
+        return FALSE;
+    }
+    msg = dbus_message_new_method_call(DB_SERVICE, "/", DB_INTERFACE, "read");
+    if (!msg) {
+        return FALSE;
+    }
+    if (!dbus_message_append_args(msg, DBUS_TYPE_STRING, &path, DBUS_TYPE_INVALID)) {
+        dbus_message_unref(msg);
+        return FALSE;
+    }
+
+    r = xcdbus_xmalloc(sizeof(dbrequest_t));
+    memset(r, 0, sizeof(*r));
+    r->c = c;
+    r->path = strdup(path);
+    r->generation = db_cache_generation(c);
+    r->read_cb = cb;
+    r->priv = priv;
+    return db_send_async(c, msg, db_read_notify, r);
+}
+
+/*
+ * Start writing a value to config database, cb (can be NULL) is told from
+ * the dispatch loop whether it succeeded. Returns 0 if the request could
+ * not be sent.
+ */
+EXTERNAL int
+xcdbus_write_db_async(xcdbus_conn_t *c, const char *path, const char *value, xcdbus_db_write_cb cb, void *priv)
+{
+    DBusMessage *msg;
+    dbrequest_t *r;
+
+    c = xcdbus_of_conn(c);
+    if (!c) {
+        return FALSE;
+    }
+    msg = dbus_message_new_method_call(DB_SERVICE, "/", DB_INTERFACE, "write");
+    if (!msg) {
+        return FALSE;
+    }
+    if (!dbus_message_append_args(msg, DBUS_TYPE_STRING, &path, DBUS_TYPE_STRING, &value,
+                                  DBUS_TYPE_INVALID)) {
+        dbus_message_unref(msg);
+        return FALSE;
+    }
+
+    r = xcdbus_xmalloc(sizeof(dbrequest_t));
+    memset(r, 0, sizeof(*r));
+    r->c = c;
+    r->path = strdup(path);
+    r->value = strdup(value);
+    r->write_cb = cb;
+    r->priv = priv;
+    return db_send_async(c, msg, db_write_notify, r);
+}
+
+/*
+ * Read many values from config database in one pipelined burst. All reads
+ * are sent before waiting for the first reply; with the db cache enabled,
+ * cached paths are not sent and replies fill the cache. Returns NULL if
+ * nothing could be read, otherwise a single malloc'd block holding n entries and their
+ * NUL terminated values, to be released with free(). Values longer than
+ * max_value_len (0 for no limit) are cut and flagged XCDBUS_DB_TRUNCATED.
+ */
+EXTERNAL xcdbus_db_values_t *
+xcdbus_read_db_many(xcdbus_conn_t *c, const char **paths, int n, size_t max_value_len)
+{
+    struct inflight {
+        DBusPendingCall *pending;
+        DBusMessage *reply;
+        /* copy of a cache hit */
+        char *cached;
+        const char *value;
+        size_t len;
+    } *r;
+    xcdbus_db_values_t *out;
+    size_t size, offset;
+    int i, sent = 0;
+    unsigned long generation;
+    int64_t start;
+
+    c = xcdbus_of_conn(c);
+    if (!c || n <= 0) {
+        return NULL;
+    }
+
+    r = xcdbus_xmalloc(n * sizeof(struct inflight));
+    memset(r, 0, n * sizeof(struct inflight));
+    generation = db_cache_generation(c);
+    start = xcdbus_now_us();
+
+    for (i = 0; i < n; ++i) {
+        DBusMessage *msg;
+
+        if (c->dbcache && (r[i].cached = db_cache_lookup(c, paths[i]))) {
+            ++sent;
+            continue;
+        }
+        msg = dbus_message_new_method_call(DB_SERVICE, "/", DB_INTERFACE, "read");
+        if (!msg) {
+            continue;
+        }
+        if (dbus_message_append_args(msg, DBUS_TYPE_STRING, &paths[i], DBUS_TYPE_INVALID) &&
+            dbus_connection_send_with_reply(c->conn, msg, &r[i].pending, BLOCKING_TIMEOUT) &&
+            r[i].pending)
+        {
+            ++sent;
+        }
+        dbus_message_unref(msg);
+    }
+    if (!sent) {
+        xcdbus_xfree(r);
+        return NULL;
+    }
+
+    size = sizeof(xcdbus_db_values_t) + (n - 1) * sizeof(xcdbus_db_value_t);
+    for (i = 0; i < n; ++i) {
+        if (r[i].cached) {
+            r[i].value = r[i].cached;
+            r[i].len = strlen(r[i].value);
+            size += (max_value_len && r[i].len > max_value_len ? max_value_len : r[i].len) + 1;
+            continue;
+        }
+        if (!r[i].pending) {
+            continue;
+        }
+        r[i].reply = pending_reply(r[i].pending, DB_SERVICE, "read", start);
+
+        if (r[i].reply &&
+            dbus_message_get_type(r[i].reply) == DBUS_MESSAGE_TYPE_METHOD_RETURN &&
+            dbus_message_get_args(r[i].reply, NULL, DBUS_TYPE_STRING, &r[i].value, DBUS_TYPE_INVALID))
+        {
+            r[i].len = strlen(r[i].value);
+            size += (max_value_len && r[i].len > max_value_len ? max_value_len : r[i].len) + 1;
+            db_cache_fill(c, paths[i], r[i].value, generation);
+        } else {
+            r[i].value = NULL;
+        }
+    }
+    /* the batch held the caller up as one call would */
+    stall_check(c, DB_SERVICE, "read", xcdbus_now_us() - start);
+
+    out = xcdbus_xmalloc(size);
+    out->n = n;
+    offset = sizeof(xcdbus_db_values_t) + (n - 1) * sizeof(xcdbus_db_value_t);
+    for (i = 0; i < n; ++i) {
+        xcdbus_db_value_t *v = &out->v[i];
+        size_t copy;
+
+        v->len = r[i].len;
+        v->offset = 0;
+        if (!r[i].value) {
+            v->status = XCDBUS_DB_ERROR;
+        } else {
+            copy = max_value_len && r[i].len > max_value_len ? max_value_len : r[i].len;
+            v->status = copy < r[i].len ? XCDBUS_DB_TRUNCATED : XCDBUS_DB_OK;
+            v->offset = offset;
+            memcpy((char *) out + offset, r[i].value, copy);
+            ((char *) out)[offset + copy] = 0;
+            offset += copy + 1;
+        }
+        if (r[i].reply) {
+            dbus_message_unref(r[i].reply);
+        }
+        xcdbus_xfree(r[i].cached);
+    }
+
+    xcdbus_xfree(r);
+    return out;
+}
+
+/*
+ * Value i of a xcdbus_read_db_many result, NULL if it could not be read
+ */
+EXTERNAL const char *
+xcdbus_db_value(const xcdbus_db_values_t *vals, int i)
+{
+    if (!vals || i < 0 || i >= vals->n || vals->v[i].status == XCDBUS_DB_ERROR) {
+        return NULL;
+    }
+    return (const char *) vals + vals->v[i].offset;
+}
+
+/*
+ * Serve xcdbus_read_db from a client side cache of at most max_entries
+ * values (0 for no bound), each trusted for ttl_ms (0 for as long as the
+ * database daemon keeps running). Writes through xcdbus_write_db update
+ * it. Changes made by other clients are only seen after expiry or
+ * xcdbus_db_cache_invalidate. Calling it again resets the cache.
+ */
+EXTERNAL void
+xcdbus_db_cache_enable(xcdbus_conn_t *c, unsigned int max_entries, int ttl_ms)
+{
+    c = xcdbus_of_conn(c);
+    if (!c) {
+        return;
+    }
+    xcdbus_registry_lock();
+    xcdbus_dbcache_free(c->dbcache);
+    c->dbcache = xcdbus_dbcache_new(max_entries, ttl_ms);
+    xcdbus_registry_unlock();
+    /* a restarted daemon may hold anything */
+    watch_name_owner(c, DB_SERVICE);
+}
+
+EXTERNAL void
+xcdbus_db_cache_disable(xcdbus_conn_t *c)
+{
+    c = xcdbus_of_conn(c);
+    if (!c) {
+        return;
+    }
+    xcdbus_registry_lock();
+    xcdbus_dbcache_free(c->dbcache);
+    c->dbcache = NULL;
+    xcdbus_registry_unlock();
+}
+
+/*
+ * Drop the cached value of path and of every node below it, or the whole
+ * cache if path is NULL
+ */
+EXTERNAL void
+xcdbus_db_cache_invalidate(xcdbus_conn_t *c, const char *path)
+{
+    c = xcdbus_of_conn(c);
+    if (!c || !c->dbcache) {
+        return;
+    }
+    db_cache_invalidate(c, path);
+}
+
+/*
+ * Cache hit and miss counters since it was enabled, returns 0 if disabled
+ */
+EXTERNAL int
+xcdbus_db_cache_stats(xcdbus_conn_t *c, unsigned long *hits, unsigned long *misses, unsigned int *entries)
+{
+    int on;
+
+    c = xcdbus_of_conn(c);
+    if (!c) {
+        return 0;
+    }
+    xcdbus_registry_lock();
+    on = c->dbcache != NULL;
+    if (on) {
+        xcdbus_dbcache_stats(c->dbcache, hits, misses, entries);
+    }
+    xcdbus_registry_unlock();
+    return on;
+}
+
+/*
+ * Number of asynchronous db requests still waiting for their reply
+ */
+EXTERNAL int
+xcdbus_db_pending(xcdbus_conn_t *c)
+{
+    c = xcdbus_of_conn(c);
+    return c ? c->db_inflight : 0;
+}
+
 /*
  * Check if xenmgr service is online
  */
 EXTERNAL int
 xcdbus_xenmgr_online(xcdbus_conn_t *c)
 {
+    xcdbus_track_name_owner(c, XENMGR_SERVICE);
     return xcdbus_name_has_owner(c, XENMGR_SERVICE);
 }
 
 /*
  * Get list of active domain ids from xenmgr. Return 0 on RPC problem. Set num_domains to number
- * of domids written.
+ * of domids written, which stops at the buffer size; see xcdbus_xenmgr_get_domids.
  */
 EXTERNAL int
 xcdbus_xenmgr_list_domids(xcdbus_conn_t *c, int32_t *out_domids, size_t out_domids_bufsz, int *out_num_domains)
 {
+    xcdbus_conn_t *xc = xcdbus_of_conn(c);
     GArray *arr = NULL;
-    int i = 0;
+    GHashTable *set;
+    int i = 0, r;
     *out_num_domains = 0;
 
+    if (xc) {
+        r = xcdbus_read_begin();
+        set = vm_domids_peek(xc);
+        if (set) {
+            GHashTableIter it;
+            gpointer key;
+
+            g_hash_table_iter_init(&it, set);
+            while (i < out_domids_bufsz / sizeof(int32_t) && g_hash_table_iter_next(&it, &key, NULL)) {
+                out_domids[i++] = GPOINTER_TO_INT(key);
+            }
+            *out_num_domains = i;
+        }
+        xcdbus_read_end(r);
+        if (set) {
+            return TRUE;
+        }
+    }
+
     if (!com_citrix_xenclient_xenmgr_list_domids_(c, XENMGR_SERVICE, XENMGR_OBJ, &arr)) {
         return FALSE;
     }
@@ -700,24 +4052,151 @@ xcdbus_xenmgr_list_domids(xcdbus_conn_t *c, int32_t *out_domids, size_t out_domi
     return TRUE;
 }
 
+/*
+ * Keep the set of running domids in memory, read once from xenmgr and again
+ * after its vm_state_changed signals, so xcdbus_xenmgr_has_domid and
+ * xcdbus_xenmgr_get_domids answer without a round trip. cb (can be NULL)
+ * is called from the dispatch loop for each domain appearing or going;
+ * calling this again replaces it.
+ */
+EXTERNAL void
+xcdbus_xenmgr_track_domids(xcdbus_conn_t *c, xcdbus_domain_cb cb, void *priv)
+{
+    c = xcdbus_of_conn(c);
+    if (!c) {
+        return;
+    }
+    c->vm_cb = cb;
+    c->vm_priv = priv;
+    if (c->vm_tracking) {
+        return;
+    }
+    c->vm_tracking = 1;
+    /* no error argument, so this does not block on a reply */
+    dbus_bus_add_match(c->conn, VM_STATE_MATCH_RULE, NULL);
+    watch_name_owner(c, XENMGR_SERVICE);
+    vm_refresh(c);
+}
+
+/*
+ * 1 if domid is running, 0 if not, -1 if not known yet: the set is not
+ * tracked, not read yet, or xenmgr is gone
+ */
+EXTERNAL int
+xcdbus_xenmgr_has_domid(xcdbus_conn_t *c, int32_t domid)
+{
+    GHashTable *set;
+    int has = -1, r;
+
+    c = xcdbus_of_conn(c);
+    if (!c) {
+        return -1;
+    }
+    r = xcdbus_read_begin();
+    set = vm_domids_peek(c);
+    if (set) {
+        has = g_hash_table_lookup(set, GINT_TO_POINTER(domid)) != NULL;
+    }
+    xcdbus_read_end(r);
+    return has;
+}
+
+/*
+ * Running domids as a malloc'd array to be released with free(), however
+ * many there are. From memory when tracked, otherwise asks xenmgr. Returns
+ * NULL on RPC problem; *n is set to the number of domids.
+ */
+EXTERNAL int32_t *
+xcdbus_xenmgr_get_domids(xcdbus_conn_t *c, int *n)
+{
+    xcdbus_conn_t *xc = xcdbus_of_conn(c);
+    GArray *arr = NULL;
+    GHashTable *set;
+    int32_t *out = NULL;
+    int i = 0, r;
+
+    *n = 0;
+    if (xc) {
+        r = xcdbus_read_begin();
+        set = vm_domids_peek(xc);
+        if (set) {
+            GHashTableIter it;
+            gpointer key;
+
+            out = xcdbus_xmalloc(g_hash_table_size(set) * sizeof(int32_t) + 1);
+            g_hash_table_iter_init(&it, set);
+            while (g_hash_table_iter_next(&it, &key, NULL)) {
+                out[i++] = GPOINTER_TO_INT(key);
+            }
+            *n = i;
+        }
+        xcdbus_read_end(r);
+        if (out) {
+            return out;
+        }
+    }
+
+    if (!com_citrix_xenclient_xenmgr_list_domids_(c, XENMGR_SERVICE, XENMGR_OBJ, &arr)) {
+        return NULL;
+    }
+    out = xcdbus_xmalloc(arr->len * sizeof(int32_t) + 1);
+    for (i = 0; i < arr->len; ++i) {
+        out[i] = g_array_index(arr, gint, i);
+    }
+    *n = i;
+    g_array_free(arr, TRUE);
+    return out;
+}
+
 /*
  * Check if input demon RPC service is up
  */
 EXTERNAL int
 xcdbus_input_online(xcdbus_conn_t *conn)
 {
+    xcdbus_track_name_owner(conn, INPUT_SERVICE);
     return xcdbus_name_has_owner(conn, INPUT_SERVICE);
 }
 
+/*
+ * Keep the focused domain id in memory from the input daemon's focus
+ * signal, so xcdbus_input_get_focus_domid answers without a round trip.
+ * The daemon is only asked when tracking starts and when it reappears on
+ * the bus. cb (can be NULL) is called from the dispatch loop when focus
+ * moves; calling this again replaces it.
+ */
+EXTERNAL void
+xcdbus_input_track_focus(xcdbus_conn_t *c, xcdbus_focus_cb cb, void *priv)
+{
+    c = xcdbus_of_conn(c);
+    if (!c) {
+        return;
+    }
+    c->focus_cb = cb;
+    c->focus_priv = priv;
+    if (c->focus_tracking) {
+        return;
+    }
+    c->focus_tracking = 1;
+    /* no error argument, so this does not block on a reply */
+    dbus_bus_add_match(c->conn, FOCUS_MATCH_RULE, NULL);
+    watch_name_owner(c, INPUT_SERVICE);
+    focus_query(c);
+}
+
 /*
  * Get focused domain id from input demon. Return 0 on RPC error
  */
 EXTERNAL int
 xcdbus_input_get_focus_domid(xcdbus_conn_t *c, int32_t *out_domid)
 {
-    DBusMessage *msg, *reply;
-    DBusMessageIter args;
+    DBusMessage *msg = NULL, *reply = NULL;
+    xcdbus_conn_t *xc = xcdbus_of_conn(c);
     *out_domid = 0;
+    if (xc && xc->focus_known) {
+        *out_domid = xc->focus_domid;
+        return 1;
+    }
     msg = dbus_message_new_method_call(
         INPUT_SERVICE,
         INPUT_OBJ,
@@ -725,7 +4204,7 @@ xcdbus_input_get_focus_domid(xcdbus_conn_t *c, int32_t *out_domid)
         "get_focus_domid");
     if (!msg)
         goto error;
-    reply = dbus_connection_send_with_reply_and_block(c->conn, msg, BLOCKING_TIMEOUT, NULL);
+    reply = call_blocking(c, msg);
     if (!reply)
         goto error;
     dbus_message_get_args(reply, NULL, DBUS_TYPE_INT32, out_domid, DBUS_TYPE_INVALID);
@@ -770,34 +4249,232 @@ EXTERNAL void xcdbus_free (xcdbus_conn_t * c)
 {
 }
 
+/* room for the key of a service, objpath, interface triple */
+#define TRIPLE_KEY_SIZE(s, o, i) (strlen(s) + strlen(o) + strlen(i) + 3)
+
+/* "service objpath interface" into key, returns the length of service */
+static size_t
+triple_key(char *key, const char *service, const char *objpath, const char *interface)
+{
+    size_t slen = strlen(service), olen = strlen(objpath);
+
+    memcpy(key, service, slen);
+    key[slen] = PROXY_KEY_SEP;
+    memcpy(key + slen + 1, objpath, olen);
+    key[slen + olen + 1] = PROXY_KEY_SEP;
+    strcpy(key + slen + olen + 2, interface);
+    return slen;
+}
+
+/*
+ * Proxy for the interface of objpath on service, made once per triple and
+ * cached on the connection. The cache is not bounded: the proxy is
+ * borrowed, must not be unreferenced and stays valid until xcdbus_shutdown.
+ */
 EXTERNAL DBusGProxy*
 xcdbus_get_proxy(xcdbus_conn_t *c, const char *service, const char *objpath, const char *interface)
 {
-    int i;
+    char *key = alloca(TRIPLE_KEY_SIZE(service, objpath, interface));
+    proxyentry_t *e;
+    DBusGProxy *proxy = NULL;
+
     /* fixup accidental usage of other pointer type */
-    DBusGConnection *conn = xcdbus_of_conn(c)->connG;
-
-    for (i = 0; i < num_proxy_entries; ++i) {
-        proxyentry_t *e = &proxy_entries[i];
-        if (e->conn == conn &&
-            !strcmp(e->service, service) &&
-            !strcmp(e->objpath, objpath) &&
-            !strcmp(e->interface, interface))
-        {
-            return e->proxy;
+    c = xcdbus_of_conn(c);
+    if (!c) {
+        return NULL;
+    }
+
+    triple_key(key, service, objpath, interface);
+
+    if (xcdbus_thread_safe()) {
+        /* hits do not lock. Entries are only removed at shutdown, the
+         * proxy outlives the snapshot */
+        GHashTable *snap;
+        int r = xcdbus_read_begin();
+        snap = g_atomic_pointer_get(&c->proxy_snap);
+        if (snap && (e = g_hash_table_lookup(snap, key))) {
+            proxy = e->proxy;
+        }
+        xcdbus_read_end(r);
+        if (proxy) {
+            return proxy;
         }
     }
-    ++num_proxy_entries;
-    proxy_entries = realloc( proxy_entries, num_proxy_entries * sizeof(struct proxyentry) );
-    proxyentry_t *e = &proxy_entries[num_proxy_entries-1];
-    e->conn = conn;
-    e->service = strdup(service);
-    e->objpath = strdup(objpath);
-    e->interface = strdup(interface);
-    e->proxy = dbus_g_proxy_new_for_name(conn, service, objpath, interface);
-    return e->proxy;
+
+    xcdbus_registry_lock();
+    e = g_hash_table_lookup(c->proxies, key);
+    if (e) {
+        proxy = e->proxy;
+        xcdbus_registry_unlock();
+        return proxy;
+    }
+
+    e = xcdbus_xmalloc(sizeof(proxyentry_t));
+    e->c = c;
+    e->key = strdup(key);
+    e->proxy = dbus_g_proxy_new_for_name(c->connG, service, objpath, interface);
+    g_hash_table_insert(c->proxies, e->key, e);
+    proxy = e->proxy;
+    proxy_cache_publish(c);
+    xcdbus_registry_unlock();
+
+    watch_name_owner(c, service);
+    return proxy;
+}
+
+static propmirror_t *
+mirror_lookup(xcdbus_conn_t *c, const char *service, const char *objpath, const char *interface)
+{
+    char *key;
+
+    if (!g_hash_table_size(c->mirrors)) {
+        return NULL;
+    }
+    key = alloca(TRIPLE_KEY_SIZE(service, objpath, interface));
+    triple_key(key, service, objpath, interface);
+    return g_hash_table_lookup(c->mirrors, key);
+}
+
+/*
+ * properties mirrored for the triple, fetched with one GetAll unless known;
+ * NULL if not mirrored, or if GetAll failed, which is not tried again
+ * before the service changes owner. Pass *r to xcdbus_read_end once done
+ * with them.
+ */
+static xcdbus_props_t *
+mirror_props(xcdbus_conn_t *c, const char *service, const char *objpath, const char *interface, int *r)
+{
+    propmirror_t *pm;
+    xcdbus_props_t *props, *p;
+    int fetch;
+
+    *r = xcdbus_read_begin();
+    xcdbus_registry_lock();
+    pm = mirror_lookup(c, service, objpath, interface);
+    props = pm ? pm->props : NULL;
+    fetch = pm && !props && !pm->getall_failed;
+    xcdbus_registry_unlock();
+    if (!fetch) {
+        return props;
+    }
+
+    /* a read held over a blocking call would hold frees back */
+    xcdbus_read_end(*r);
+    p = xcdbus_get_all_properties(c, service, objpath, interface);
+    *r = xcdbus_read_begin();
+    xcdbus_registry_lock();
+    pm = mirror_lookup(c, service, objpath, interface);
+    if (pm && !pm->props && !pm->getall_failed) {
+        pm->props = p;
+        pm->getall_failed = !p;
+        p = NULL;
+    }
+    props = pm ? pm->props : NULL;
+    xcdbus_registry_unlock();
+    /* unmirrored, or fetched by another thread meanwhile */
+    xcdbus_props_free(p);
+    return props;
+}
+
+/*
+ * Answer xcdbus_get_property_* for interface on objpath from memory. All
+ * its properties are fetched with one GetAll on first use, then kept
+ * current from PropertiesChanged signals and dropped when service changes
+ * owner. cb (can be NULL) is called from the dispatch loop with the name of
+ * each property that changed, or NULL when all may have; it must not
+ * mirror or unmirror anything. Mirroring a triple again replaces its
+ * callback.
+ */
+EXTERNAL int
+xcdbus_mirror_properties(
+    xcdbus_conn_t *c,
+    const char *service,
+    const char *objpath,
+    const char *interface,
+    xcdbus_prop_changed_cb cb,
+    void *priv)
+{
+    propmirror_t *pm;
+
+    c = xcdbus_of_conn(c);
+    if (!c) {
+        return 0;
+    }
+    /* registration stays with the dispatching thread, so nothing races the
+     * lookup; the lock keeps the table consistent for readers */
+    xcdbus_registry_lock();
+    pm = mirror_lookup(c, service, objpath, interface);
+    xcdbus_registry_unlock();
+    if (!pm) {
+        pm = g_new0(propmirror_t, 1);
+        pm->c = c;
+        pm->key = g_malloc(TRIPLE_KEY_SIZE(service, objpath, interface));
+        triple_key(pm->key, service, objpath, interface);
+        pm->service = g_strdup(service);
+        pm->objpath = g_strdup(objpath);
+        pm->interface = g_strdup(interface);
+        pm->rule = g_strdup_printf("type='signal',sender='%s',path='%s',"
+                                   "interface='org.freedesktop.DBus.Properties',"
+                                   "member='PropertiesChanged',arg0='%s'",
+                                   service, objpath, interface);
+        /* no error argument, so this does not block on a reply */
+        dbus_bus_add_match(c->conn, pm->rule, NULL);
+        xcdbus_registry_lock();
+        g_hash_table_insert(c->mirrors, pm->key, pm);
+        xcdbus_registry_unlock();
+        watch_name_owner(c, service);
+    }
+    pm->cb = cb;
+    pm->priv = priv;
+    return 1;
+}
+
+EXTERNAL void
+xcdbus_unmirror_properties(
+    xcdbus_conn_t *c,
+    const char *service,
+    const char *objpath,
+    const char *interface)
+{
+    propmirror_t *pm;
+
+    c = xcdbus_of_conn(c);
+    if (!c) {
+        return;
+    }
+    xcdbus_registry_lock();
+    pm = mirror_lookup(c, service, objpath, interface);
+    if (pm) {
+        /* frees the mirror */
+        g_hash_table_remove(c->mirrors, pm->key);
+    }
+    xcdbus_registry_unlock();
 }
 
+/* org.freedesktop.DBus.Properties.Get through call_blocking, the reply or NULL */
+static DBusMessage *
+property_get_call(
+    xcdbus_conn_t *c,
+    const char *service,
+    const char *objpath,
+    const char *interface,
+    const char *property)
+{
+    DBusMessage *msg, *reply;
+
+    msg = dbus_message_new_method_call(service, objpath, "org.freedesktop.DBus.Properties", "Get");
+    if (!msg) {
+        return NULL;
+    }
+    if (!dbus_message_append_args(msg, DBUS_TYPE_STRING, &interface, DBUS_TYPE_STRING, &property,
+                                  DBUS_TYPE_INVALID)) {
+        dbus_message_unref(msg);
+        return NULL;
+    }
+    reply = call_blocking(c, msg);
+    dbus_message_unref(msg);
+    return reply;
+}
 
 EXTERNAL int
 xcdbus_get_property_var(
@@ -810,16 +4487,60 @@ xcdbus_get_property_var(
 {
     GError *error = NULL;
     GValue v = { 0, 0 };
-    DBusGProxy *p = xcdbus_get_proxy(c, service, objpath, "org.freedesktop.DBus.Properties");
+    DBusGProxy *p;
+    int64_t start;
+    int ok, r;
 
+    c = xcdbus_of_conn(c);
+    if (!c) {
+        return 0;
+    }
+    ok = xcdbus_props_get_value(mirror_props(c, service, objpath, interface, &r), property, outv);
+    xcdbus_read_end(r);
+    /* not in GetAll, which may have failed, or of an unusual type: ask */
+    if (ok) {
+        return 1;
+    }
+    if (g_atomic_pointer_get(&c->pool)) {
+        /* basic types without dbus-glib, so the call can use the pool */
+        DBusMessage *reply = property_get_call(c, service, objpath, interface, property);
+        DBusMessageIter iter, var;
+        xcdbus_props_t *one;
+        int container = 0;
+
+        /* an error reply or timeout, asking again would not help */
+        if (!reply) {
+            return 0;
+        }
+        if (dbus_message_has_signature(reply, "v") && dbus_message_iter_init(reply, &iter)) {
+            dbus_message_iter_recurse(&iter, &var);
+            container = dbus_type_is_container(dbus_message_iter_get_arg_type(&var));
+        }
+        /* containers only dbus-glib turns into GValues, so ask it again */
+        if (!container) {
+            one = xcdbus_props_of_get_reply(reply, property);
+            dbus_message_unref(reply);
+            ok = xcdbus_props_get_value(one, property, outv);
+            xcdbus_props_free(one);
+            return ok;
+        }
+        dbus_message_unref(reply);
+    }
+
+    p = xcdbus_get_proxy(c, service, objpath, "org.freedesktop.DBus.Properties");
     if (!p) {
         return 0;
     }
-    if (!dbus_g_proxy_call(
+    start = xcdbus_now_us();
+    ok = dbus_g_proxy_call(
             p, "Get", &error,
             G_TYPE_STRING, interface, G_TYPE_STRING, property, DBUS_TYPE_INVALID,
-            G_TYPE_VALUE, &v, DBUS_TYPE_INVALID ))
-    {
+            G_TYPE_VALUE, &v, DBUS_TYPE_INVALID );
+    stats_gcall(c, service, "Get", ok, error, start);
+    if (error) {
+        g_error_free(error);
+    }
+    if (!ok) {
         return 0;
     }
     *outv = v;
@@ -838,21 +4559,123 @@ xcdbus_set_property_var(
 {
     GError *error = NULL;
     DBusGProxy *p = xcdbus_get_proxy(c, service, objpath, "org.freedesktop.DBus.Properties");
+    propmirror_t *pm;
+    int64_t start;
+    int ok;
 
     if (!p) {
         return 0;
     }
-    if (!dbus_g_proxy_call(
+    start = xcdbus_now_us();
+    ok = dbus_g_proxy_call(
             p, "Set", &error,
             G_TYPE_STRING, interface, G_TYPE_STRING, property,
-            G_TYPE_VALUE, inpv, DBUS_TYPE_INVALID, DBUS_TYPE_INVALID ))
-    {
+            G_TYPE_VALUE, inpv, DBUS_TYPE_INVALID, DBUS_TYPE_INVALID );
+    stats_gcall(xcdbus_of_conn(c), service, "Set", ok, error, start);
+    if (error) {
+        g_error_free(error);
+    }
+    if (!ok) {
         return 0;
     }
+    /* do not serve the old value until PropertiesChanged comes in */
+    xcdbus_registry_lock();
+    pm = mirror_lookup(xcdbus_of_conn(c), service, objpath, interface);
+    if (pm) {
+        mirror_set_props(pm, NULL);
+    }
+    xcdbus_registry_unlock();
     return 1;
 }
 
-#define stub_pget(name, typ, gtyp, gvalget)      \
+/* store a string property into out, strdup'd when out_size is 0 */
+static void
+property_string_out(const char *s, void *out, int out_size)
+{
+    if (!out_size) {
+        *(char **) out = strdup(s);
+        return;
+    }
+    strncpy((char *) out, s, out_size - 1);
+    ((char *) out)[out_size - 1] = 0;
+}
+
+/*
+ * Property of basic D-Bus type dtype straight into out, using libdbus only:
+ * no proxy, no GValue. Answered from memory if the triple is mirrored.
+ * 16 bit integers are widened and other types must match, which accepts
+ * the same values as the GValue checks of the xcdbus_get_property_* did.
+ */
+static int
+property_read_basic(
+    xcdbus_conn_t *c,
+    const char *service,
+    const char *objpath,
+    const char *interface,
+    const char *property,
+    int dtype,
+    void *out,
+    int out_size)
+{
+    DBusMessage *reply;
+    DBusMessageIter iter, var;
+    xcdbus_props_t *props;
+    const char *s;
+    int type, r, ok = 0;
+
+    c = xcdbus_of_conn(c);
+    if (!c) {
+        return 0;
+    }
+    props = mirror_props(c, service, objpath, interface, &r);
+    if (dtype != DBUS_TYPE_STRING) {
+        ok = xcdbus_props_get_basic(props, property, dtype, out);
+    } else if ((s = xcdbus_props_peek_string(props, property))) {
+        /* the string lives in props, copy it out before the read ends */
+        property_string_out(s, out, out_size);
+        ok = 1;
+    }
+    xcdbus_read_end(r);
+    if (ok) {
+        return 1;
+    }
+
+    reply = property_get_call(c, service, objpath, interface, property);
+    if (!reply) {
+        return 0;
+    }
+    if (dbus_message_get_type(reply) != DBUS_MESSAGE_TYPE_METHOD_RETURN ||
+        !dbus_message_iter_init(reply, &iter) ||
+        dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_VARIANT) {
+        goto out;
+    }
+    dbus_message_iter_recurse(&iter, &var);
+    type = dbus_message_iter_get_arg_type(&var);
+    if (type == DBUS_TYPE_INT16 && dtype == DBUS_TYPE_INT32) {
+        dbus_int16_t v;
+        dbus_message_iter_get_basic(&var, &v);
+        *(dbus_int32_t *) out = v;
+        ok = 1;
+    } else if (type == DBUS_TYPE_UINT16 && dtype == DBUS_TYPE_UINT32) {
+        dbus_uint16_t v;
+        dbus_message_iter_get_basic(&var, &v);
+        *(dbus_uint32_t *) out = v;
+        ok = 1;
+    } else if (type == dtype && dtype == DBUS_TYPE_STRING) {
+        const char *s;
+        dbus_message_iter_get_basic(&var, &s);
+        property_string_out(s, out, out_size);
+        ok = 1;
+    } else if (type == dtype) {
+        dbus_message_iter_get_basic(&var, out);
+        ok = 1;
+    }
+out:
+    dbus_message_unref(reply);
+    return ok;
+}
+
+#define stub_pget(name, typ, dtyp, ctyp)      \
 int \
 xcdbus_get_property_##name( \
     xcdbus_conn_t *c, \
@@ -862,17 +4685,12 @@ xcdbus_get_property_##name( \
     const char *property, \
     typ *outv) \
 { \
-    GValue var; \
-    if (!xcdbus_get_property_var(c,service,objpath,interface,property,&var)) { \
+    ctyp v; \
+    if (!property_read_basic(c,service,objpath,interface,property,dtyp,&v,0)) { \
         return 0; \
     } \
-    if (G_VALUE_HOLDS(&var, gtyp)) { \
-        *outv = gvalget(&var); \
-        g_value_unset(&var); \
-        return 1; \
-    } \
-    g_value_unset(&var); \
-    return 0; \
+    *outv = v; \
+    return 1; \
 }
 
 #define stub_pset(name, typ, gtyp, gvalset)      \
@@ -894,31 +4712,205 @@ xcdbus_set_property_##name( \
     return r; \
 }
 
-static const char* dup_gval_str(GValue *v)
-{
-    return strdup(g_value_get_string(v));
-}
-
-EXTERNAL stub_pget(string, char*, G_TYPE_STRING, dup_gval_str);
+EXTERNAL stub_pget(string, char*, DBUS_TYPE_STRING, char*);
 EXTERNAL stub_pset(string, const char*, G_TYPE_STRING, g_value_set_string);
 
-EXTERNAL stub_pget(bool, gboolean, G_TYPE_BOOLEAN, g_value_get_boolean);
+EXTERNAL stub_pget(bool, gboolean, DBUS_TYPE_BOOLEAN, dbus_bool_t);
 EXTERNAL stub_pset(bool, gboolean, G_TYPE_BOOLEAN, g_value_set_boolean);
 
-EXTERNAL stub_pget(int, gint, G_TYPE_INT, g_value_get_int);
+EXTERNAL stub_pget(int, gint, DBUS_TYPE_INT32, dbus_int32_t);
 EXTERNAL stub_pset(int, gint, G_TYPE_INT, g_value_set_int);
 
-EXTERNAL stub_pget(uint, guint, G_TYPE_UINT, g_value_get_uint);
+EXTERNAL stub_pget(uint, guint, DBUS_TYPE_UINT32, dbus_uint32_t);
 EXTERNAL stub_pset(uint, guint, G_TYPE_UINT, g_value_set_uint);
 
-EXTERNAL stub_pget(int64, gint64, G_TYPE_INT64, g_value_get_int64);
+EXTERNAL stub_pget(int64, gint64, DBUS_TYPE_INT64, dbus_int64_t);
 EXTERNAL stub_pset(int64, gint64, G_TYPE_INT64, g_value_set_int64);
 
-EXTERNAL stub_pget(uint64, guint64, G_TYPE_UINT64, g_value_get_uint64);
+EXTERNAL stub_pget(uint64, guint64, DBUS_TYPE_UINT64, dbus_uint64_t);
 EXTERNAL stub_pset(uint64, guint64, G_TYPE_UINT64, g_value_set_uint64);
 
-EXTERNAL stub_pget(double, gdouble, G_TYPE_DOUBLE, g_value_get_double);
+EXTERNAL stub_pget(double, gdouble, DBUS_TYPE_DOUBLE, double);
 EXTERNAL stub_pset(double, gdouble, G_TYPE_DOUBLE, g_value_set_double);
 
-EXTERNAL stub_pget(byte, unsigned char, G_TYPE_UCHAR, g_value_get_uchar);
+EXTERNAL stub_pget(byte, unsigned char, DBUS_TYPE_BYTE, unsigned char);
 EXTERNAL stub_pset(byte, unsigned char, G_TYPE_UCHAR, g_value_set_uchar);
+
+static DBusMessage *
+getall_new(const char *service, const char *objpath, const char *interface)
+{
+    DBusMessage *msg = dbus_message_new_method_call(service, objpath,
+                                                    "org.freedesktop.DBus.Properties",
+                                                    "GetAll");
+    if (!msg) {
+        return NULL;
+    }
+    if (!dbus_message_append_args(msg, DBUS_TYPE_STRING, &interface, DBUS_TYPE_INVALID)) {
+        dbus_message_unref(msg);
+        return NULL;
+    }
+    return msg;
+}
+
+/*
+ * Fetch all properties of interface on n objects of service with one GetAll
+ * each, all sent before waiting for the first reply. out[i] gets the set of
+ * objpaths[i], NULL if it could not be fetched, each to be released with
+ * xcdbus_props_free. Returns the number of sets fetched.
+ */
+EXTERNAL int
+xcdbus_get_all_properties_many(
+    xcdbus_conn_t *c,
+    const char *service,
+    const char **objpaths,
+    int n,
+    const char *interface,
+    xcdbus_props_t **out)
+{
+    DBusPendingCall **pending;
+    int i, got = 0;
+    int64_t start;
+
+    c = xcdbus_of_conn(c);
+    if (!c || n <= 0) {
+        return 0;
+    }
+
+    start = xcdbus_now_us();
+    pending = xcdbus_xmalloc(n * sizeof(DBusPendingCall *));
+    memset(pending, 0, n * sizeof(DBusPendingCall *));
+    for (i = 0; i < n; ++i) {
+        DBusMessage *msg = getall_new(service, objpaths[i], interface);
+        out[i] = NULL;
+        if (!msg) {
+            continue;
+        }
+        if (!dbus_connection_send_with_reply(c->conn, msg, &pending[i], BLOCKING_TIMEOUT)) {
+            pending[i] = NULL;
+        }
+        dbus_message_unref(msg);
+    }
+
+    for (i = 0; i < n; ++i) {
+        DBusMessage *reply;
+        if (!pending[i]) {
+            continue;
+        }
+        reply = pending_reply(pending[i], service, "GetAll", start);
+        out[i] = xcdbus_props_of_reply(reply);
+        if (out[i]) {
+            ++got;
+        }
+        if (reply) {
+            dbus_message_unref(reply);
+        }
+    }
+
+    stall_check(c, service, "GetAll", xcdbus_now_us() - start);
+
+    xcdbus_xfree(pending);
+    return got;
+}
+
+/*
+ * All properties of interface on one object in a single round trip, NULL on
+ * error; release with xcdbus_props_free
+ */
+EXTERNAL xcdbus_props_t *
+xcdbus_get_all_properties(
+    xcdbus_conn_t *c,
+    const char *service,
+    const char *objpath,
+    const char *interface)
+{
+    xcdbus_props_t *p = NULL;
+    xcdbus_get_all_properties_many(c, service, &objpath, 1, interface, &p);
+    return p;
+}
+
+typedef struct propsrequest {
+    xcdbus_conn_t *c;
+    char *objpath;
+    xcdbus_props_cb cb;
+    void *priv;
+} propsrequest_t;
+
+static void
+props_request_free(void *data)
+{
+    propsrequest_t *r = (propsrequest_t *) data;
+    xcdbus_xfree(r->objpath);
+    xcdbus_xfree(r);
+}
+
+static void
+props_notify(DBusPendingCall *pending, void *data)
+{
+    propsrequest_t *r = (propsrequest_t *) data;
+    DBusMessage *reply = dbus_pending_call_steal_reply(pending);
+    xcdbus_props_t *p = xcdbus_props_of_reply(reply);
+
+    r->cb(r->c, r->objpath, p, r->priv);
+    xcdbus_props_free(p);
+    if (reply) {
+        dbus_message_unref(reply);
+    }
+    pending_done(r->c, pending);
+}
+
+/*
+ * Start fetching all properties of interface on objpath. Returns 0 if the
+ * request could not be sent. Otherwise cb gets the set from the dispatch
+ * loop, or NULL on error; the set is only valid during the callback.
+ */
+EXTERNAL int
+xcdbus_get_all_properties_async(
+    xcdbus_conn_t *c,
+    const char *service,
+    const char *objpath,
+    const char *interface,
+    xcdbus_props_cb cb,
+    void *priv)
+{
+    DBusMessage *msg;
+    propsrequest_t *r;
+    int ok;
+
+    c = xcdbus_of_conn(c);
+    if (!c || !cb) {
+        return FALSE;
+    }
+    msg = getall_new(service, objpath, interface);
+    if (!msg) {
+        return FALSE;
+    }
+    r = xcdbus_xmalloc(sizeof(propsrequest_t));
+    r->c = c;
+    r->objpath = strdup(objpath);
+    r->cb = cb;
+    r->priv = priv;
+    ok = send_async(c, msg, props_notify, r, props_request_free, NULL);
+    dbus_message_unref(msg);
+    return ok;
+}
+
+/*
+ * String property into buf, cut to buf_size - 1 characters and always NUL
+ * terminated. Unlike xcdbus_get_property_string nothing is allocated for
+ * the caller. Returns 0 on error or if the property is not a string.
+ */
+EXTERNAL int
+xcdbus_get_property_string_buf(
+    xcdbus_conn_t *c,
+    const char *service,
+    const char *objpath,
+    const char *interface,
+    const char *property,
+    char *buf,
+    int buf_size)
+{
+    if (buf_size <= 0) {
+        return 0;
+    }
+    return property_read_basic(c, service, objpath, interface, property, DBUS_TYPE_STRING, buf, buf_size);
+}